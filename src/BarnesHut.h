@@ -1,85 +1,250 @@
 #pragma once
-#include <SFML/Graphics.hpp>
+#include <SFML/System/Vector2.hpp>
 #include <vector>
 #include <cmath>
 #include "Body.h"
-#include "Screen.h"
+#include "GravityKernel.h"
 #include "QuadTree.h"
-#include "CollisionHandler.h"
+#include "ThreadPool.h"
+
+#if defined(__GNUC__)
+#define BH_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define BH_PREFETCH(address) ((void)0)
+#endif
+
+// Sources collected by one leaf-group walk. Far nodes are evaluated with
+// the vector kernel, near nodes (centre of mass within eps of the group)
+// are checked against eps per body like the single-body walk does.
+struct InteractionList
+{
+	std::vector<float> x, y, mass, qxx, qxy, qyy;
+	std::vector<float> near_x, near_y, near_mass;
+
+	void clear()
+	{
+		x.clear();
+		y.clear();
+		mass.clear();
+		qxx.clear();
+		qxy.clear();
+		qyy.clear();
+		near_x.clear();
+		near_y.clear();
+		near_mass.clear();
+	}
+};
 
 class BarnesHut
 {
 public:
-	std::vector<Body>& bodies;
+	Bodies& bodies;
 	float threshold;
 	float eps = 0.0001;
-	QuadTree head;
+	// head covers the moving bodies, fixedTree the fixed ones, which are
+	// kept at the front of bodies (see updateFixedTree)
+	QuadTree head, fixedTree;
 	int maxLeafSize;
+	// Walk the tree once per leaf instead of once per body
+	bool groupWalk = true;
+	// Add the quadrupole term of accepted nodes, not just their monopole
+	bool useQuadrupole = true;
 
-	BarnesHut(std::vector<Body>& bodies, float threshold, int maxLeafSize) 
-		: bodies(bodies), threshold(threshold), maxLeafSize(maxLeafSize), head(bodies, maxLeafSize){}
+	std::vector<int> leafs;
+	std::vector<InteractionList> interactions;
 
-	void createTree()
+	BarnesHut(Bodies& bodies, float threshold, int maxLeafSize) 
+		: bodies(bodies), threshold(threshold), maxLeafSize(maxLeafSize), head(bodies, maxLeafSize), fixedTree(bodies, maxLeafSize)
 	{
-		sf::Vector2f center(Screen::X / 2, Screen::Y / 2);
-		head.build();
+		fixedTree.bodyEnd = 0;
 	}
 
-	void applyGravity(int num_threads) const
+	// refit false rebuilds head even when it could be refitted
+	void createTree(ThreadPool& pool, bool refit = true)
 	{
-		const int batch_size = bodies.size() / num_threads;
-		if (batch_size > 0) {
-			std::vector<std::thread> threads;
-			for (int i = 0; i < num_threads; i++)
+		updateFixedTree(pool);
+		head.build(pool, refit);
+	}
+
+	// Takes effect at the next createTree, which rebuilds both trees
+	void setMaxLeafSize(int size)
+	{
+		maxLeafSize = head.maxLeafSize = fixedTree.maxLeafSize = size;
+		checked_version = ~0ull;
+		rebuild_fixed = true;
+	}
+
+	// Fixed bodies never move, so they are kept out of head and get a tree
+	// of their own, rebuilt only when the set of fixed bodies changes. Its
+	// centres of mass and moments are then reused by every walk until the
+	// next change. The fixed bodies are moved to the front of bodies, where
+	// later additions and removals of moving bodies do not shift them.
+	void updateFixedTree(ThreadPool& pool)
+	{
+		if (bodies.fixedVersion == checked_version)
+			return;
+		int fixed_count = 0;
+		bool in_front = true;
+		for (size_t i = 0; i < bodies.size(); i++)
+		{
+			if (!bodies.isFixed(i))
+				continue;
+			in_front = in_front && i == fixed_count;
+			fixed_count++;
+		}
+
+		if (!in_front)
+		{
+			partition_order.clear();
+			for (size_t i = 0; i < bodies.size(); i++)
 			{
-				const int start = i * batch_size, end = (i + 1) * batch_size;
-				threads.emplace_back([this, start, end]() {
-					for (int i = start; i < end; i++) {
-						getAcceleration(i);
-					}
-				});
+				if (bodies.isFixed(i))
+					partition_order.push_back(i);
 			}
-			for (int i = 0; i < num_threads; i++) {
-				threads[i].join();
+			for (size_t i = 0; i < bodies.size(); i++)
+			{
+				if (!bodies.isFixed(i))
+					partition_order.push_back(i);
 			}
+			bodies.permute(partition_order, pool, fixedTree.scratch);
 		}
-		for (int i = 0; i < int(bodies.size()) % num_threads; i++)
+		if (!in_front || fixed_count != fixedTree.bodyEnd || rebuild_fixed)
 		{
-			getAcceleration(int(bodies.size()) - 1 - i);
+			fixedTree.bodyEnd = fixed_count;
+			if (fixed_count > 0)
+				fixedTree.build(pool);
+			else
+				fixedTree.nodes.clear();
 		}
+		head.bodyBegin = fixed_count;
+		checked_version = bodies.fixedVersion;
+		rebuild_fixed = false;
+	}
 
-		for (int i = 0; i < bodies.size(); i++)
+	void applyGravity(ThreadPool& pool)
+	{
+		if (groupWalk)
 		{
-			if (isnan(bodies[i].acceleration.x) || isnan(bodies[i].acceleration.y) || isinf(bodies[i].acceleration.x) || isinf(bodies[i].acceleration.y))
-			{
-				bodies.erase(bodies.begin() + i);
-				i--;
-			}
+			applyGravityToLeafs(pool, false);
+		}
+		else
+		{
+			// Bodies in dense clusters open far more nodes than isolated ones, so
+			// the walk is scheduled in small chunks that threads claim dynamically.
+			const int chunk = std::max(32, int(head.order.size()) / (pool.size() * 16));
+			pool.parallelForDynamic(0, head.order.size(), chunk, [this](int start, int end, int) {
+				for (int slot = start; slot < end; slot++) {
+					getAcceleration(slot);
+				}
+			});
 		}
 	}
 
-	void getAcceleration(size_t body) const
+	// Adds the pull of the fixed bodies to accelerations computed by another
+	// solver from head alone
+	void applyFixedGravity(ThreadPool& pool)
 	{
-		if (bodies[body].fixed || !bodies[body].enabled)
-			return;
-		getAccelerationHelper(body);
-		bodies[body].acceleration *= Constants::G;
+		if (!fixedTree.nodes.empty())
+			applyGravityToLeafs(pool, true);
 	}
 
-	void getAccelerationHelper(size_t index) const
+	void applyGravityToLeafs(ThreadPool& pool, bool fixedOnly)
 	{
-		Body& body = bodies[index];
-		int node_index = 0;
+		leafs.clear();
+		for (int i = 0; i < head.nodes.size(); i++)
+		{
+			if (head.nodes[i].isLeaf() && !head.nodes[i].isEmpty())
+				leafs.push_back(i);
+		}
+		interactions.resize(pool.size());
 
-		while (true)
+		const int chunk = std::max(4, int(leafs.size()) / (pool.size() * 16));
+		pool.parallelForDynamic(0, leafs.size(), chunk, [this, fixedOnly](int start, int end, int thread) {
+			for (int i = start; i < end; i++) {
+				applyGravityToLeaf(leafs[i], interactions[thread], fixedOnly);
+			}
+		});
+	}
+
+	// With fixedOnly only fixedTree is walked and the result is added to
+	// the bodies' accelerations instead of replacing them.
+	void applyGravityToLeaf(int leaf_index, InteractionList& list, bool fixedOnly = false) const
+	{
+		const Node& leaf = head.nodes[leaf_index];
+		float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+		for (int j = leaf.start; j < leaf.end; j++)
 		{
-			const Node& node = head.nodes[node_index];
+			const int i = head.order[j];
+			if (bodies.isFixed(i) || !bodies.isEnabled(i))
+				continue;
+			min_x = std::min(min_x, bodies.x[i]);
+			min_y = std::min(min_y, bodies.y[i]);
+			max_x = std::max(max_x, bodies.x[i]);
+			max_y = std::max(max_y, bodies.y[i]);
+		}
+		if (min_x > max_x)
+			return;
 
-			sf::Vector2f delta(node.center_mass.x - body.center.x, node.center_mass.y - body.center.y);
-			float d = sqrt(delta.x * delta.x + delta.y * delta.y);
+		list.clear();
+		if (!fixedOnly)
+			buildInteractionList(head, leaf.start, leaf.end, min_x, min_y, max_x, max_y, list);
+		if (!fixedTree.nodes.empty())
+			buildInteractionList(fixedTree, -1, -1, min_x, min_y, max_x, max_y, list);
 
+		const GravityKernel::Kernel& kernel = GravityKernel::get();
+		const float eps2 = eps * eps;
+		for (int j = leaf.start; j < leaf.end; j++)
+		{
+			const int i = head.order[j];
+			if (bodies.isFixed(i) || !bodies.isEnabled(i))
+				continue;
+			const float x = bodies.x[i], y = bodies.y[i];
+			float ax = 0, ay = 0;
+			if (useQuadrupole)
+				kernel.accumulateQuadrupole(list.x.data(), list.y.data(), list.mass.data(),
+					list.qxx.data(), list.qxy.data(), list.qyy.data(), int(list.x.size()), x, y, ax, ay);
+			else
+				kernel.accumulate(list.x.data(), list.y.data(), list.mass.data(), int(list.x.size()), x, y, ax, ay);
+			for (size_t k = 0; k < list.near_x.size(); k++)
+			{
+				float dx = list.near_x[k] - x, dy = list.near_y[k] - y;
+				float d2 = dx * dx + dy * dy;
+				if (d2 < eps2)
+					continue;
+				float s = list.near_mass[k] / (d2 * std::sqrt(d2));
+				ax += s * dx;
+				ay += s * dy;
+			}
+			if (fixedOnly)
+			{
+				bodies.ax[i] += ax * Constants::G;
+				bodies.ay[i] += ay * Constants::G;
+			}
+			else
+			{
+				bodies.ax[i] = ax * Constants::G;
+				bodies.ay[i] = ay * Constants::G;
+			}
+		}
+	}
+
+	// One walk of `tree` for every body of a leaf, using the bounding box of
+	// its bodies, appending to list. A node is accepted when the opening
+	// criterion holds for the closest point of the box, so it holds for
+	// every body in the group. Nodes that contain the tree slots
+	// [leaf_start, leaf_end), the leaf itself when walking its own tree,
+	// are opened and the leaf is skipped, matching the single-body walk.
+	void buildInteractionList(const QuadTree& tree, int leaf_start, int leaf_end, float min_x, float min_y, float max_x, float max_y, InteractionList& list) const
+	{
+		const float threshold2 = threshold * threshold, eps2 = eps * eps;
+		int node_index = 0;
 
-			if (node.isEmpty() || (d < eps))
+		while (true)
+		{
+			const WalkNode& node = tree.walkNodes[node_index];
+			// Opening moves to the next node, which is already close, skipping jumps to next
+			BH_PREFETCH(&tree.walkNodes[node.next]);
+			if (node.mass == 0)
 			{
 				if (node.next == 0)
 					break;
@@ -87,25 +252,143 @@ public:
 				continue;
 			}
 
-			if ((node.isLeaf() || (node.bottom_right.x - node.top_left.x) / d < threshold) && !(index >= node.start && index < node.end))
+			float dx = std::max(0.0f, std::max(min_x - node.cx, node.cx - max_x));
+			float dy = std::max(0.0f, std::max(min_y - node.cy, node.cy - max_y));
+			float d2 = dx * dx + dy * dy;
+
+			if (node.children != 0 && !(node.size * node.size < threshold2 * d2))
+			{
+				node_index = node.children;
+				continue;
+			}
+
+			const SlotRange& range = tree.walkRanges[node_index];
+			if (range.start <= leaf_start && leaf_end <= range.end)
 			{
-				body.acceleration += node.mass / d / d / d * delta;
+				if (node.children != 0)
+				{
+					node_index = node.children;
+					continue;
+				}
+			}
+			else if (d2 < eps2)
+			{
+				list.near_x.push_back(node.cx);
+				list.near_y.push_back(node.cy);
+				list.near_mass.push_back(node.mass);
+			}
+			else
+			{
+				// Leaves are accepted even when they fail the opening test, the
+				// expansion does not hold that close and only the monopole is used
+				const WalkMoments q = node.size * node.size < threshold2 * d2 ? tree.walkMoments[node_index] : WalkMoments{ 0, 0, 0 };
+				list.x.push_back(node.cx);
+				list.y.push_back(node.cy);
+				list.mass.push_back(node.mass);
+				list.qxx.push_back(q.qxx);
+				list.qxy.push_back(q.qxy);
+				list.qyy.push_back(q.qyy);
+			}
+
+			if (node.next == 0)
+				break;
+			node_index = node.next;
+		}
+	}
+
+	// Gravity on the body in tree slot `slot` of head
+	void getAcceleration(int slot) const
+	{
+		const int body = head.order[slot];
+		if (bodies.isFixed(body) || !bodies.isEnabled(body))
+			return;
+		const float x = bodies.x[body], y = bodies.y[body];
+		sf::Vector2f acceleration = getAccelerationHelper(head, x, y, slot);
+		if (!fixedTree.nodes.empty())
+			acceleration += getAccelerationHelper(fixedTree, x, y, -1);
+		bodies.ax[body] = acceleration.x * Constants::G;
+		bodies.ay[body] = acceleration.y * Constants::G;
+	}
+
+	// Walks `tree` for a body at (x, y), skipping the leaf that holds tree
+	// slot `slot` (-1 when the body is not in the tree). Accepted nodes are
+	// gathered into a small buffer and evaluated by the vectorized
+	// GravityKernel in batches.
+	sf::Vector2f getAccelerationHelper(const QuadTree& tree, float x, float y, int slot) const
+	{
+		const int BATCH = 64;
+		alignas(64) float sx[BATCH], sy[BATCH], sm[BATCH], sxx[BATCH], sxy[BATCH], syy[BATCH];
+		int count = 0;
+
+		const GravityKernel::Kernel& kernel = GravityKernel::get();
+		const float threshold2 = threshold * threshold, eps2 = eps * eps;
+		float ax = 0, ay = 0;
+		int node_index = 0;
+
+		auto flush = [&]() {
+			if (useQuadrupole)
+				kernel.accumulateQuadrupole(sx, sy, sm, sxx, sxy, syy, count, x, y, ax, ay);
+			else
+				kernel.accumulate(sx, sy, sm, count, x, y, ax, ay);
+			count = 0;
+		};
+
+		while (true)
+		{
+			const WalkNode& node = tree.walkNodes[node_index];
+			BH_PREFETCH(&tree.walkNodes[node.next]);
+
+			float dx = node.cx - x, dy = node.cy - y;
+			float d2 = dx * dx + dy * dy;
 
+			if (node.mass == 0 || (d2 < eps2))
+			{
 				if (node.next == 0)
 					break;
-
 				node_index = node.next;
+				continue;
 			}
-			else if (!node.isLeaf())
+
+			if (node.children != 0 && !(node.size * node.size < threshold2 * d2))
 			{
 				node_index = node.children;
+				continue;
+			}
+
+			const SlotRange& range = tree.walkRanges[node_index];
+			if (slot >= range.start && slot < range.end)
+			{
+				if (node.children != 0)
+				{
+					node_index = node.children;
+					continue;
+				}
 			}
 			else
 			{
-				if (node.next == 0)
-					break;
-				node_index = node.next;
+				// Leaves are accepted even when they fail the opening test, the
+				// expansion does not hold that close and only the monopole is used
+				const WalkMoments q = node.size * node.size < threshold2 * d2 ? tree.walkMoments[node_index] : WalkMoments{ 0, 0, 0 };
+				sx[count] = node.cx;
+				sy[count] = node.cy;
+				sm[count] = node.mass;
+				sxx[count] = q.qxx;
+				sxy[count] = q.qxy;
+				syy[count] = q.qyy;
+				if (++count == BATCH)
+					flush();
 			}
+
+			if (node.next == 0)
+				break;
+			node_index = node.next;
 		}
+		flush();
+		return sf::Vector2f(ax, ay);
 	}
+
+private:
+	uint64_t checked_version = ~0ull;
+	bool rebuild_fixed = false;
+	std::vector<int> partition_order;
 };
\ No newline at end of file
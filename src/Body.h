@@ -1,143 +1,357 @@
 #pragma once
-#include "Screen.h"
-#include <SFML/Graphics.hpp>
+#include "Constants.h"
+#include "FrameArena.h"
+#include "ThreadPool.h"
+#include <SFML/System/Vector2.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <math.h>
+#include <vector>
 
-class alignas(64) Body
+// Description of a single body, used to spawn, load and inspect bodies.
+// The simulation itself keeps bodies in the structure-of-arrays Bodies.
+class Body
 {
 public:
 	sf::Vector2f center, prev_center;
 	float mass, radius;
-
-	sf::CircleShape* circle = new sf::CircleShape();
-	sf::Vertex* point = new sf::Vertex();
-
-	sf::Vector2f acceleration;
-	bool fixed, isVertex = true;
+	bool fixed;
 	bool enabled = true;
 
 	Body(sf::Vector2f center, float mass, float radius, sf::Vector2f velocity, bool fixed) :
-		center(center), prev_center(center - velocity), mass(mass), radius(radius), acceleration(0, 0), fixed(fixed)
+		center(center), prev_center(center - velocity), mass(mass), radius(radius), fixed(fixed) {}
+};
+
+// Refers to one body wherever the tree reorders or compaction moves it.
+// An id is reused once its body is gone, generation tells the two apart.
+struct BodyHandle
+{
+	uint32_t id = 0, generation = 0;
+};
+
+// Body storage with one contiguous array per field, so the tree build,
+// gravity walk, collisions and integration only stream the fields they use.
+//
+// Bodies are removed by disabling them, which is O(1) and leaves every
+// index valid until compact() drops all disabled bodies in one pass. The
+// simulation compacts at the end of a step, once everything holding
+// indices is done with them, and at the start of the next one if the
+// caller removed bodies in between.
+class Bodies
+{
+public:
+	enum Flags : uint8_t
+	{
+		ENABLED = 1 << 0,
+		FIXED = 1 << 1
+	};
+
+	std::vector<float> x, y, prev_x, prev_y;
+	std::vector<float> mass, radius;
+	std::vector<float> ax, ay;
+	std::vector<uint8_t> flags;
+	// Handle id of every body
+	std::vector<uint32_t> ids;
+	// Incremented whenever bodies are added, removed or moved to other
+	// indices, so structures holding body indices can tell they are stale
+	uint64_t layoutVersion = 0;
+	// Incremented whenever bodies are added or compacted away, but not when
+	// they are only moved
+	uint64_t membershipVersion = 0;
+	// Incremented only when a fixed body is added, removed or moved to
+	// another index, so the fixed body tree can tell it is stale
+	uint64_t fixedVersion = 0;
+
+	size_t size() const
 	{
-		point->position = center;
-		point->color = Screen::BODY_COLOR;
-		circle->setFillColor(Screen::BODY_COLOR);
-		circle->setRadius(radius);
-		circle->setOrigin(radius, radius);
-		circle->setPosition(center);
-		update_drawables();
+		return x.size();
 	}
 
-	void setAcceleration(sf::Vector2f _acceleration)
+	bool empty() const
 	{
-		acceleration = _acceleration;
+		return x.empty();
 	}
 
-	void checkForNan()
+	BodyHandle push_back(const Body& body)
 	{
-		if (isinf(center.x) || isnan(center.x) || isinf(center.y) || isnan(center.y))
+		uint32_t id;
+		if (free_ids.empty())
 		{
-			center.x = 0;
-			center.y = 0;
-			mass = 0;
-			radius = 0.01;
-			enabled = false;
+			id = uint32_t(id_index.size());
+			id_index.push_back(0);
+			id_generation.push_back(0);
 		}
+		else
+		{
+			id = free_ids.back();
+			free_ids.pop_back();
+		}
+		id_index[id] = uint32_t(x.size());
+		ids.push_back(id);
+
+		x.push_back(body.center.x);
+		y.push_back(body.center.y);
+		prev_x.push_back(body.prev_center.x);
+		prev_y.push_back(body.prev_center.y);
+		mass.push_back(body.mass);
+		radius.push_back(body.radius);
+		ax.push_back(0);
+		ay.push_back(0);
+		flags.push_back((body.enabled ? ENABLED : 0) | (body.fixed ? FIXED : 0));
+		layoutVersion++;
+		membershipVersion++;
+		fixedVersion += body.fixed;
+		return { id, id_generation[id] };
 	}
 
-	void update(float dt)
+	BodyHandle handle(size_t i) const
 	{
-		if (!enabled || fixed)
-			return;
-		sf::Vector2f velocity = center - prev_center;
-		prev_center = center;
-		center += velocity + acceleration * dt * dt;
-		checkForNan();
+		return { ids[i], id_generation[ids[i]] };
 	}
 
-	void draw(sf::RenderWindow& window)
+	// Current index of the body, -1 once it has been compacted away
+	int indexOf(BodyHandle handle) const
 	{
-		if (!isInWindow())
-			return;
-		if (isVertex)
-		{
-			point->position = center;
-			window.draw(point, 1, sf::Points);
-		}
-		else
+		if (handle.id >= id_index.size() || id_generation[handle.id] != handle.generation)
+			return -1;
+		return id_index[handle.id];
+	}
+
+	Body get(size_t i) const
+	{
+		Body body(sf::Vector2f(x[i], y[i]), mass[i], radius[i], sf::Vector2f(x[i] - prev_x[i], y[i] - prev_y[i]), isFixed(i));
+		body.enabled = isEnabled(i);
+		return body;
+	}
+
+	// Marks the body for the next compact(), it takes no further part
+	void remove(size_t i)
+	{
+		flags[i] &= ~ENABLED;
+	}
+
+	// Drops every disabled body, keeping the order of the rest, and
+	// releases their handles
+	void compact()
+	{
+		size_t kept = 0;
+		bool fixed_moved = false;
+		while (kept < size() && isEnabled(kept))
+			kept++;
+		for (size_t i = kept; i < size(); i++)
 		{
-			circle->setPosition(center);
-			window.draw(*circle);
+			fixed_moved = fixed_moved || isFixed(i);
+			if (!isEnabled(i))
+			{
+				id_generation[ids[i]]++;
+				free_ids.push_back(ids[i]);
+				continue;
+			}
+			if (kept != i)
+			{
+				x[kept] = x[i];
+				y[kept] = y[i];
+				prev_x[kept] = prev_x[i];
+				prev_y[kept] = prev_y[i];
+				mass[kept] = mass[i];
+				radius[kept] = radius[i];
+				ax[kept] = ax[i];
+				ay[kept] = ay[i];
+				flags[kept] = flags[i];
+				ids[kept] = ids[i];
+				id_index[ids[kept]] = uint32_t(kept);
+			}
+			kept++;
 		}
+		if (kept == size())
+			return;
+		x.resize(kept);
+		y.resize(kept);
+		prev_x.resize(kept);
+		prev_y.resize(kept);
+		mass.resize(kept);
+		radius.resize(kept);
+		ax.resize(kept);
+		ay.resize(kept);
+		flags.resize(kept);
+		ids.resize(kept);
+		layoutVersion++;
+		membershipVersion++;
+		fixedVersion += fixed_moved;
 	}
 
-	void update_drawables()
+	void swap(size_t i, size_t j)
 	{
-		if (!enabled)
-			return;
-		float pixel_radius = Screen::convertMetersToPixels(sf::Vector2f(radius, radius)).x;
-		if (pixel_radius > 1)
-			isVertex = false;
-		else
-			isVertex = true;
+		std::swap(x[i], x[j]);
+		std::swap(y[i], y[j]);
+		std::swap(prev_x[i], prev_x[j]);
+		std::swap(prev_y[i], prev_y[j]);
+		std::swap(mass[i], mass[j]);
+		std::swap(radius[i], radius[j]);
+		std::swap(ax[i], ax[j]);
+		std::swap(ay[i], ay[j]);
+		std::swap(flags[i], flags[j]);
+		std::swap(ids[i], ids[j]);
+		id_index[ids[i]] = uint32_t(i);
+		id_index[ids[j]] = uint32_t(j);
+		layoutVersion++;
+		fixedVersion += isFixed(i) || isFixed(j);
 	}
 
-	bool isInWindow()
+	// Reorders every field so that body i moves to position first + j where
+	// order[j] == i. Only the bodies [first, first + order.size()) move, and
+	// order is a permutation of them. The copies are taken from scratch.
+	void permute(const std::vector<int>& order, ThreadPool& pool, FrameArena& scratch, size_t first = 0)
 	{
-		if (!enabled)
-			return false;
-		int Xn = std::max(Screen::TOP_LEFT.x, std::min(center.x, Screen::BOTTOM_RIGHT.x));
-		int Yn = std::max(Screen::TOP_LEFT.y, std::min(center.y, Screen::BOTTOM_RIGHT.y));
-		int Dx = Xn - center.x;
-		int Dy = Yn - center.y;
-		return (Dx * Dx + Dy * Dy) <= radius * radius;
+		gather(x, order, first, pool, scratch);
+		gather(y, order, first, pool, scratch);
+		gather(prev_x, order, first, pool, scratch);
+		gather(prev_y, order, first, pool, scratch);
+		gather(mass, order, first, pool, scratch);
+		gather(radius, order, first, pool, scratch);
+		gather(ax, order, first, pool, scratch);
+		gather(ay, order, first, pool, scratch);
+		gather(flags, order, first, pool, scratch);
+		gather(ids, order, first, pool, scratch);
+		std::atomic<bool> fixed_moved(false);
+		pool.parallelFor(first, first + order.size(), [this, &order, first, &fixed_moved](int start, int end) {
+			bool moved = false;
+			for (int i = start; i < end; i++)
+			{
+				id_index[ids[i]] = uint32_t(i);
+				moved = moved || (isFixed(i) && order[i - first] != i);
+			}
+			if (moved)
+				fixed_moved = true;
+		});
+		layoutVersion++;
+		fixedVersion += fixed_moved;
+	}
+
+	void reserve(size_t n)
+	{
+		x.reserve(n);
+		y.reserve(n);
+		prev_x.reserve(n);
+		prev_y.reserve(n);
+		mass.reserve(n);
+		radius.reserve(n);
+		ax.reserve(n);
+		ay.reserve(n);
+		flags.reserve(n);
+		ids.reserve(n);
+	}
+
+	inline bool isEnabled(size_t i) const
+	{
+		return flags[i] & ENABLED;
 	}
 
-	void checkBounds()
+	inline bool isFixed(size_t i) const
 	{
-		if (center.x >= Screen::X)
-			center.x = Screen::X - 1;
-		if (center.x <= 0)
-			center.x = 1;
-		if (center.y >= Screen::Y)
-			center.y = Screen::Y - 1;
-		if (center.y <= 0)
-			center.y = 1;
+		return flags[i] & FIXED;
 	}
 
-	void handleCollision(Body& other)
+	void checkForNan(size_t i)
 	{
-		if (!enabled || !other.enabled)
+		if (isinf(x[i]) || isnan(x[i]) || isinf(y[i]) || isnan(y[i]))
+		{
+			x[i] = 0;
+			y[i] = 0;
+			mass[i] = 0;
+			radius[i] = 0.01;
+			flags[i] &= ~ENABLED;
+		}
+	}
+
+	void update(size_t i, float dt)
+	{
+		if (!isEnabled(i) || isFixed(i))
 			return;
-		if (fixed && other.fixed)
+		float vx = x[i] - prev_x[i], vy = y[i] - prev_y[i];
+		prev_x[i] = x[i];
+		prev_y[i] = y[i];
+		x[i] += vx + ax[i] * dt * dt;
+		y[i] += vy + ay[i] * dt * dt;
+		checkForNan(i);
+	}
+
+	void handleCollision(size_t i, size_t j)
+	{
+		if (isFixed(i) && isFixed(j))
 			return;
-		float dx = other.center.x - center.x, dy = other.center.y - center.y;
-		float min_distance = radius + other.radius;
-		float distance = std::sqrt(dx * dx + dy * dy);
-		if (distance > min_distance)
+		sf::Vector2f vec_distance_to_add;
+		if (!overlap(i, j, vec_distance_to_add))
 			return;
-		float distance_to_add = (min_distance - distance);
 
-		float total_part = std::max(0.1f, abs(dx) + abs(dy));
-		float dx_part = dx / total_part;
-		float dy_part = dy / total_part;
-		sf::Vector2f vec_distance_to_add(distance_to_add * dx_part, distance_to_add * dy_part);
-
-		float mass_ratio = mass / (mass + other.mass);
-		if (fixed)
+		float mass_ratio = mass[i] / (mass[i] + mass[j]);
+		if (isFixed(i))
 			mass_ratio = 1;
 		else
 		{
-			center.x -= vec_distance_to_add.x * (1 - mass_ratio);
-			center.y -= vec_distance_to_add.y * (1 - mass_ratio);
-			checkForNan();
+			x[i] -= vec_distance_to_add.x * (1 - mass_ratio);
+			y[i] -= vec_distance_to_add.y * (1 - mass_ratio);
+			checkForNan(i);
 		}
-		if (!other.fixed)
+		if (!isFixed(j))
 		{
-			other.center.x += vec_distance_to_add.x * mass_ratio;
-			other.center.y += vec_distance_to_add.y * mass_ratio;
-			other.checkForNan();
+			x[j] += vec_distance_to_add.x * mass_ratio;
+			y[j] += vec_distance_to_add.y * mass_ratio;
+			checkForNan(j);
 		}
 	}
-};
\ No newline at end of file
+
+	// Adds to push the part of the overlap with j that moves i, without
+	// moving either. Matches handleCollision, except that a fixed j always
+	// pushes i the whole way out.
+	void addCollisionPush(size_t i, size_t j, float& push_x, float& push_y) const
+	{
+		if (isFixed(i))
+			return;
+		sf::Vector2f vec_distance_to_add;
+		if (!overlap(i, j, vec_distance_to_add))
+			return;
+		const float share = isFixed(j) ? 1 : mass[j] / (mass[i] + mass[j]);
+		push_x -= vec_distance_to_add.x * share;
+		push_y -= vec_distance_to_add.y * share;
+	}
+
+	// The separation that resolves the overlap of two enabled bodies, along
+	// the direction from i to j. False when they do not touch.
+	bool overlap(size_t i, size_t j, sf::Vector2f& vec_distance_to_add) const
+	{
+		if (!isEnabled(i) || !isEnabled(j))
+			return false;
+		float dx = x[j] - x[i], dy = y[j] - y[i];
+		float min_distance = radius[i] + radius[j];
+		float distance = std::sqrt(dx * dx + dy * dy);
+		if (distance > min_distance)
+			return false;
+		float distance_to_add = (min_distance - distance);
+
+		float total_part = std::max(0.1f, std::abs(dx) + std::abs(dy));
+		float dx_part = dx / total_part;
+		float dy_part = dy / total_part;
+		vec_distance_to_add = sf::Vector2f(distance_to_add * dx_part, distance_to_add * dy_part);
+		return true;
+	}
+
+private:
+	// Index and generation of every id, and the ids free for reuse
+	std::vector<uint32_t> id_index, id_generation, free_ids;
+
+	template <typename T>
+	static void gather(std::vector<T>& field, const std::vector<int>& order, size_t first, ThreadPool& pool, FrameArena& scratch)
+	{
+		T* copy = scratch.allocate<T>(order.size());
+		pool.parallelFor(0, order.size(), [&field, first, copy](int start, int end) {
+			std::copy(field.begin() + first + start, field.begin() + first + end, copy + start);
+		});
+		pool.parallelFor(0, order.size(), [&field, &order, first, copy](int start, int end) {
+			for (int j = start; j < end; j++)
+				field[first + j] = copy[order[j] - first];
+		});
+	}
+};
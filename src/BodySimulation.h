@@ -1,61 +1,89 @@
 #pragma once
 
 #include "Body.h"
-#include "Screen.h"
 #include "BarnesHut.h"
-#include <SFML/Graphics.hpp>
+#include "CollisionHandler.h"
+#include "FastMultipole.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <vector>
 #include <thread>
 
+enum class GravitySolver
+{
+	BARNES_HUT,
+	FAST_MULTIPOLE
+};
+
 class BodySimulation
 {
 public:
-	std::vector<Body>& bodies;
+	Bodies& bodies;
 	BarnesHut bh;
+	FastMultipole fmm;
+	GravitySolver solver = GravitySolver::BARNES_HUT;
 	CollisionHandler collision_handler;
 	bool showQuadTree = false;
 	int collisionPrecision = 2;
-	int num_threads = 4;
+	ThreadPool pool;
 
 
-	BodySimulation(std::vector<Body>& bodies, float threshold, int maxLeafSize) 
-		: bodies(bodies), bh(bodies, threshold, maxLeafSize), collision_handler(bodies, bh.head),
-			num_threads(std::thread::hardware_concurrency()) {
+	BodySimulation(Bodies& bodies, float threshold, int maxLeafSize) 
+		: bodies(bodies), bh(bodies, threshold, maxLeafSize), fmm(bodies, bh.head), collision_handler(bodies, bh.head, &bh.fixedTree),
+			pool(std::max(1u, std::thread::hardware_concurrency())) {
 	}
 
+	// The phases are public as well, for the benchmark to time one by one
 	void update(float dt)
 	{
-		sf::Clock clock;
+		// Bodies removed by the caller since the last step
+		bodies.compact();
+		bh.createTree(pool, treeRefit());
+		handleCollisions();
+		applyGravity();
+		integrate(dt);
+		// Everything holding body indices is done for this step
+		bodies.compact();
+	}
 
-		bh.createTree();
+	// Whether the tree may be refitted instead of rebuilt. The multipole
+	// expansions assume every body lies inside its node's box, which a
+	// refitted tree does not keep.
+	bool treeRefit() const
+	{
+		return solver != GravitySolver::FAST_MULTIPOLE;
+	}
 
+	void handleCollisions()
+	{
 		for (int i = 0; i < collisionPrecision; i++)
-			collision_handler.handleCollisions(num_threads);
-
-		bh.applyGravity(num_threads);
+			collision_handler.handleCollisions(pool);
+	}
 
-		for (Body& body : bodies)
+	void applyGravity()
+	{
+		if (solver == GravitySolver::FAST_MULTIPOLE)
 		{
-			body.update(dt);
+			fmm.eps = bh.eps;
+			fmm.applyGravity(pool);
+			bh.applyFixedGravity(pool);
 		}
+		else
+			bh.applyGravity(pool);
+	}
 
-		for (int i = 0; i < bodies.size(); i++)
+	// Removes the bodies whose acceleration is not finite and moves the rest
+	void integrate(float dt)
+	{
+		for (size_t i = 0; i < bodies.size(); i++)
 		{
-			if (!bodies[i].enabled)
-			{
-				bodies.erase(bodies.begin() + i);
-				i--;
-			}
+			if (isnan(bodies.ax[i]) || isnan(bodies.ay[i]) || isinf(bodies.ax[i]) || isinf(bodies.ay[i]))
+				bodies.remove(i);
 		}
-	}
 
-	void draw(sf::RenderWindow& window)
-	{
-		for (Body& body : bodies)
+		for (size_t i = 0; i < bodies.size(); i++)
 		{
-			body.draw(window);
+			bodies.update(i, dt);
 		}
-		if (showQuadTree)
-			bh.head.draw(window);
 	}
 };
\ No newline at end of file
@@ -1,98 +1,893 @@
 #pragma once
-#include "BodySimulation.h"
 #include "Body.h"
+#include "CollisionKernel.h"
+#include "FrameArena.h"
+#include "QuadTree.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <vector>
-#include <thread>
 
+enum class Broadphase
+{
+	TREE,
+	GRID
+};
+
+// With the tree broadphase every pass first resolves the pairs inside each
+// leaf in order, one task per leaf. Pairs across leaves are then resolved
+// Jacobi style: each body that may reach into another leaf sums its own
+// share of the pushes from all its contacts there, reading positions only,
+// and the sums are applied once every body has been visited. A body is
+// only ever written by the task that owns its leaf, so no part runs
+// serially and the result does not depend on the thread count.
+//
+// The grid broadphase hashes the bodies into square cells twice the
+// largest radius wide, so a body can only touch bodies in its own and the
+// eight surrounding cells, and resolves every pair Jacobi style. It suits
+// near-uniform radii and falls back to the tree when the largest radius is
+// more than gridRadiusSpread times the smallest.
+//
+// With cacheContacts, the default, neither is run on every pass. Each
+// body gets the list of bodies, fixed ones included, that lie within
+// (1 + contactMargin) times their summed radii, found through the selected
+// broadphase with its reach widened by that factor.
+// Two bodies missing from each other's list cannot touch until one of
+// them has moved more than contactMargin times its radius, so the lists
+// serve every later pass and frame until that happens, and a pass only
+// tests the listed pairs and resolves them Jacobi style. The lists hold
+// handles, so the tree reordering the bodies only remaps them.
 class CollisionHandler 
 {
 public:
-	std::vector<Body>& bodies;
+	Bodies& bodies;
 	QuadTree& tree;
+	// Tree of the fixed bodies that tree leaves out, if any. They are
+	// never moved, so each leaf resolves its bodies against them on its
+	// own thread.
+	const QuadTree* fixedTree;
+	// Memory for the per-slot buffers of one pass, reset at its start
+	FrameArena scratch;
+	Broadphase broadphase = Broadphase::TREE;
+	float gridRadiusSpread = 4;
+	// Below this many bodies sorting a leaf costs more than it prunes
+	int sweepLeafSize = 2048;
+	bool cacheContacts = true;
+	float contactMargin = 0.5f;
 
-	CollisionHandler(std::vector<Body>& bodies, QuadTree& tree) : bodies(bodies), tree(tree) {}
+	CollisionHandler(Bodies& bodies, QuadTree& tree, const QuadTree* fixedTree = nullptr)
+		: bodies(bodies), tree(tree), fixedTree(fixedTree) {}
 
-	void handleCollisions(int num_threads) const
+	void handleCollisions(ThreadPool& pool)
 	{
 		// Assumes the quad tree has already been updated to the current frame
 
-		std::vector<int> leafs;
-		for (int i = 0; i < tree.nodes.size(); i++) {
-			if (tree.nodes[i].isLeaf() && !tree.nodes[i].isEmpty()) {
-				leafs.push_back(i);
-			}
+		scratch.reset();
+		if (cacheContacts)
+		{
+			handleCollisionsCached(pool);
+			return;
 		}
+		if (broadphase == Broadphase::GRID && handleCollisionsGrid(pool))
+			return;
+		handleCollisionsTree(pool);
+	}
+
+	void handleCollisionsTree(ThreadPool& pool)
+	{
+		const int node_count = tree.nodes.size(), threads = pool.size();
+		// How far inside its leaf box each body is, and the push it gets from other leaves
+		float* inside = scratch.allocate<float>(tree.order.size());
+		float* push_x = scratch.allocate<float>(tree.order.size());
+		float* push_y = scratch.allocate<float>(tree.order.size());
+		float* reach = scratch.allocate<float>(threads);
+		std::fill(reach, reach + threads, 0.0f);
+
+		const bool with_fixed = fixedTree && !fixedTree->nodes.empty();
+		sweeps.resize(threads);
+		pool.parallelForDynamic(0, node_count, 256, [this, with_fixed, inside, reach](int start, int end, int thread) {
+			for (int i = start; i < end; i++) {
+				const Node& node = tree.nodes[i];
+				if (!node.isLeaf() || node.isEmpty())
+					continue;
+				handleCollisionInLeaf(node, thread);
+				for (int slot = node.start; slot < node.end; slot++) {
+					const int j = tree.order[slot];
+					if (with_fixed)
+						handleFixedCollisions(j, fixedTree->nodes[0]);
+					float x_d = std::min(bodies.x[j] - node.top_left.x, node.bottom_right.x - bodies.x[j]);
+					float y_d = std::min(bodies.y[j] - node.top_left.y, node.bottom_right.y - bodies.y[j]);
+					inside[slot] = std::min(x_d, y_d);
+					// A refit can leave a body outside its box, reaching that much further
+					if (inside[slot] < bodies.radius[j] && bodies.isEnabled(j))
+						reach[thread] = std::max(reach[thread], bodies.radius[j] - std::min(0.0f, inside[slot]));
+				}
+			}
+		});
+
+		// Two bodies in different leaves only touch if one of them crosses
+		// its leaf's box, so the other lies within its own radius plus the
+		// largest reach of a crossing body from its box's boundary: its
+		// radius, plus how far outside the box a refit left it.
+		// The leaves such a pair can span are found once per leaf.
+		const float max_reach = *std::max_element(reach, reach + threads);
+		neighbours.resize(threads);
+		pool.parallelForDynamic(0, node_count, 256, [this, inside, push_x, push_y, max_reach](int start, int end, int thread) {
+			for (int i = start; i < end; i++) {
+				const Node& node = tree.nodes[i];
+				if (!node.isLeaf() || node.isEmpty())
+					continue;
+				bool near_edge = false;
+				for (int slot = node.start; slot < node.end; slot++) {
+					push_x[slot] = push_y[slot] = 0;
+					near_edge = near_edge || inside[slot] < bodies.radius[tree.order[slot]] + max_reach;
+				}
+				if (!near_edge)
+					continue;
+				std::vector<int>& leafs = neighbours[thread];
+				leafs.clear();
+				collectNeighbours(i, 0, leafs);
+				for (int slot = node.start; slot < node.end; slot++) {
+					if (inside[slot] < bodies.radius[tree.order[slot]] + max_reach)
+						sumCrossLeafPushes(slot, leafs, push_x[slot], push_y[slot]);
+				}
+			}
+		});
 
-		std::vector<int> edge_bodies;
-		for (int i = 0; i < leafs.size(); i++) {
-			for (int j = tree.nodes[leafs[i]].start; j < tree.nodes[leafs[i]].end; j++) {
-				float x_d = std::min(bodies[j].center.x - tree.nodes[leafs[i]].top_left.x, tree.nodes[leafs[i]].bottom_right.x - bodies[j].center.x);
-				float y_d = std::min(bodies[j].center.y - tree.nodes[leafs[i]].top_left.y, tree.nodes[leafs[i]].bottom_right.y - bodies[j].center.y);
-				if (x_d < bodies[j].radius || y_d < bodies[j].radius) {
-					edge_bodies.push_back(j);
+		pool.parallelForDynamic(0, node_count, 256, [this, push_x, push_y](int start, int end, int) {
+			for (int i = start; i < end; i++) {
+				const Node& node = tree.nodes[i];
+				if (!node.isLeaf() || node.isEmpty())
+					continue;
+				for (int slot = node.start; slot < node.end; slot++) {
+					if (push_x[slot] == 0 && push_y[slot] == 0)
+						continue;
+					const int j = tree.order[slot];
+					bodies.x[j] += push_x[slot];
+					bodies.y[j] += push_y[slot];
+					bodies.checkForNan(j);
 				}
 			}
+		});
+	}
+
+	// Bodies in tree sorted by the bucket of their cell. The bodies of
+	// bucket b are sorted[s], with their positions and scaled radii at the
+	// same s, for s in [bucket_begin[b], bucket_begin[b + 1]).
+	struct Grid
+	{
+		float inverse_cell;
+		uint32_t mask;
+		int* sorted;
+		float* x;
+		float* y;
+		float* radius;
+		int* bucket_begin;
+	};
+
+	// Hashes the bodies in tree into square cells scale times twice the
+	// largest radius wide, in memory from scratch. Returns false when the
+	// radii are too spread out for one cell size, or all zero.
+	bool buildGrid(ThreadPool& pool, float scale, Grid& grid)
+	{
+		const int first = tree.bodyBegin, count = tree.bodyCount(), threads = pool.size();
+		float* min_radius = scratch.allocate<float>(threads);
+		float* max_radius = scratch.allocate<float>(threads);
+		pool.run([this, first, count, threads, min_radius, max_radius](int thread) {
+			float low = INFINITY, high = 0;
+			for (int i = first + int(1LL * count * thread / threads); i < first + int(1LL * count * (thread + 1) / threads); i++)
+			{
+				if (!bodies.isEnabled(i))
+					continue;
+				low = std::min(low, bodies.radius[i]);
+				high = std::max(high, bodies.radius[i]);
+			}
+			min_radius[thread] = low;
+			max_radius[thread] = high;
+		});
+		const float low = *std::min_element(min_radius, min_radius + threads);
+		const float high = *std::max_element(max_radius, max_radius + threads);
+		if (!(high > 0 && high <= gridRadiusSpread * low))
+			return false;
+
+		const float inverse_cell = 1 / (2 * scale * high);
+		int buckets = 1;
+		while (buckets < count)
+			buckets *= 2;
+		const uint32_t mask = buckets - 1;
+
+		// Stable two level counting sort of the bodies by bucket, so the
+		// memory it touches does not grow with the thread count. Each thread
+		// counts and scatters one contiguous range of bodies by the top
+		// COARSE_BITS bits of their bucket, its slots following those of the
+		// ranges before it. Each coarse range is then sorted by the remaining
+		// bits on its own, into its own share of bucket_begin.
+		int bucket_bits = 0;
+		while ((1 << bucket_bits) < buckets)
+			bucket_bits++;
+		const int coarse_shift = std::max(0, bucket_bits - COARSE_BITS), coarse_count = buckets >> coarse_shift;
+		uint32_t* bucket_of = scratch.allocate<uint32_t>(count);
+		int* offsets = scratch.allocate<int>(size_t(threads) * coarse_count);
+		int* coarse_begin = scratch.allocate<int>(coarse_count + 1);
+		int* by_coarse = scratch.allocate<int>(count);
+		int* bucket_begin = scratch.allocate<int>(size_t(buckets) + 1);
+		int* bucket_fill = scratch.allocate<int>(buckets);
+		pool.run([&](int thread) {
+			int* counts = &offsets[size_t(thread) * coarse_count];
+			std::fill(counts, counts + coarse_count, 0);
+			for (int k = int(1LL * count * thread / threads); k < int(1LL * count * (thread + 1) / threads); k++)
+			{
+				bucket_of[k] = cellHash(cellOf(bodies.x[first + k], inverse_cell), cellOf(bodies.y[first + k], inverse_cell)) & mask;
+				counts[bucket_of[k] >> coarse_shift]++;
+			}
+		});
+		int sum = 0;
+		for (int c = 0; c < coarse_count; c++)
+		{
+			coarse_begin[c] = sum;
+			for (int t = 0; t < threads; t++)
+			{
+				const int n = offsets[size_t(t) * coarse_count + c];
+				offsets[size_t(t) * coarse_count + c] = sum;
+				sum += n;
+			}
 		}
+		coarse_begin[coarse_count] = count;
+		pool.run([&](int thread) {
+			int* slots = &offsets[size_t(thread) * coarse_count];
+			for (int k = int(1LL * count * thread / threads); k < int(1LL * count * (thread + 1) / threads); k++)
+				by_coarse[slots[bucket_of[k] >> coarse_shift]++] = k;
+		});
 
-		const int batch_size = leafs.size() / num_threads;
-		if (batch_size > 0) {
-			std::vector<std::thread> threads;
-			for (int i = 0; i < num_threads; i++)
+		// Positions and radii are copied in bucket order, so the candidates
+		// of a bucket are read from one contiguous run
+		int* sorted = scratch.allocate<int>(count);
+		float* sorted_x = scratch.allocate<float>(count);
+		float* sorted_y = scratch.allocate<float>(count);
+		float* sorted_radius = scratch.allocate<float>(count);
+		pool.parallelForDynamic(0, coarse_count, 1, [&](int start, int end, int) {
+			for (int c = start; c < end; c++)
 			{
-				const int start = i * batch_size, end = (i + 1) * batch_size;
-				threads.emplace_back([this, &leafs, start, end]() {
-					for (int i = start; i < end; i++) {
-						handleCollisionInLeaf(tree.nodes[leafs[i]]);
+				const int low = c << coarse_shift, high = (c + 1) << coarse_shift;
+				std::fill(bucket_fill + low, bucket_fill + high, 0);
+				for (int s = coarse_begin[c]; s < coarse_begin[c + 1]; s++)
+					bucket_fill[bucket_of[by_coarse[s]]]++;
+				int slot = coarse_begin[c];
+				for (int b = low; b < high; b++)
+				{
+					const int n = bucket_fill[b];
+					bucket_begin[b] = bucket_fill[b] = slot;
+					slot += n;
+				}
+				for (int s = coarse_begin[c]; s < coarse_begin[c + 1]; s++)
+				{
+					const int k = by_coarse[s], to = bucket_fill[bucket_of[k]]++;
+					sorted[to] = first + k;
+					sorted_x[to] = bodies.x[first + k];
+					sorted_y[to] = bodies.y[first + k];
+					sorted_radius[to] = scale * bodies.radius[first + k];
+				}
+			}
+		});
+		bucket_begin[buckets] = count;
+		grid = Grid{ inverse_cell, mask, sorted, sorted_x, sorted_y, sorted_radius, bucket_begin };
+		return true;
+	}
+
+	// Returns false, without touching any body, when buildGrid does
+	bool handleCollisionsGrid(ThreadPool& pool)
+	{
+		Grid grid;
+		if (!buildGrid(pool, 1, grid))
+			return false;
+		const int first = tree.bodyBegin, count = tree.bodyCount();
+
+		// Bodies are visited in index order, which after the tree's
+		// reordering is Morton order, so consecutive bodies mostly look at
+		// the same buckets
+		float* push_x = scratch.allocate<float>(count);
+		float* push_y = scratch.allocate<float>(count);
+		pool.parallelForDynamic(0, count, 256, [&](int start, int end, int) {
+			for (int k = start; k < end; k++)
+			{
+				const int i = first + k;
+				const float x = bodies.x[i], y = bodies.y[i], r = bodies.radius[i];
+				float px = 0, py = 0;
+				uint32_t buckets[9];
+				const int bucket_count = gridBuckets(grid, x, y, buckets);
+				for (int n = 0; n < bucket_count; n++)
+				{
+					const uint32_t b = buckets[n];
+					for (int s = grid.bucket_begin[b]; s < grid.bucket_begin[b + 1]; s++)
+					{
+						const float ddx = grid.x[s] - x, ddy = grid.y[s] - y, reach = r + grid.radius[s];
+						if (ddx * ddx + ddy * ddy <= reach * reach && grid.sorted[s] != i)
+							bodies.addCollisionPush(i, grid.sorted[s], px, py);
 					}
-				});
+				}
+				push_x[i - first] = px;
+				push_y[i - first] = py;
 			}
-			for (int i = 0; i < num_threads; i++) {
-				threads[i].join();
+		});
+
+		const bool with_fixed = fixedTree && !fixedTree->nodes.empty();
+		pool.parallelFor(0, count, [this, first, push_x, push_y, with_fixed](int start, int end) {
+			for (int k = start; k < end; k++)
+			{
+				const int i = first + k;
+				if (push_x[k] != 0 || push_y[k] != 0)
+				{
+					bodies.x[i] += push_x[k];
+					bodies.y[i] += push_y[k];
+					bodies.checkForNan(i);
+				}
+				if (with_fixed)
+					handleFixedCollisions(i, fixedTree->nodes[0]);
 			}
+		});
+		return true;
+	}
+
+	void handleCollisionsCached(ThreadPool& pool)
+	{
+		// Bodies added or removed, or moved in or out of tree, are missing
+		// from the lists or have stale handles there
+		if (contacts_membership != bodies.membershipVersion || contacts_tree_begin != tree.bodyBegin)
+			refreshContacts(pool);
+		else
+		{
+			if (contacts_layout != bodies.layoutVersion)
+				remapContacts(pool);
+			if (contactsMovedOut(pool))
+				refreshContacts(pool);
 		}
-		for (int i = 0; i < int(leafs.size()) % num_threads; i++)
+
+		const int count = contact_owner.size();
+		float* push_x = scratch.allocate<float>(count);
+		float* push_y = scratch.allocate<float>(count);
+		pool.parallelForDynamic(0, count, 256, [this, push_x, push_y](int start, int end, int) {
+			for (int k = start; k < end; k++)
+			{
+				const int i = owner_index[k];
+				float px = 0, py = 0;
+				if (i >= 0)
+				{
+					for (int c = contact_begin[k]; c < contact_begin[k + 1]; c++)
+					{
+						if (other_index[c] >= 0)
+							bodies.addCollisionPush(i, other_index[c], px, py);
+					}
+				}
+				push_x[k] = px;
+				push_y[k] = py;
+			}
+		});
+		pool.parallelFor(0, count, [this, push_x, push_y](int start, int end) {
+			for (int k = start; k < end; k++)
+			{
+				if (push_x[k] == 0 && push_y[k] == 0)
+					continue;
+				const int i = owner_index[k];
+				bodies.x[i] += push_x[k];
+				bodies.y[i] += push_y[k];
+				bodies.checkForNan(i);
+			}
+		});
+	}
+
+	// Rebuilds the contact lists of the bodies in tree from their current
+	// positions, through the grid when that broadphase is selected and the
+	// radii allow it and through the tree otherwise. The tree must be up
+	// to date.
+	void refreshContacts(ThreadPool& pool)
+	{
+		const int threads = pool.size();
+		const float scale = 1 + contactMargin;
+		const bool with_fixed = fixedTree && !fixedTree->nodes.empty();
+		contact_buffers.resize(threads);
+		sweeps.resize(threads);
+		// Which thread gets which bodies varies, so each buffer is given room
+		// for all of the last lists, and each sweep for the most candidates
+		// any thread has tested at once, to not allocate during a step
+		for (ContactBuffer& buffer : contact_buffers)
+			buffer.clear(contact_owner.size(), contact_other.size());
+		size_t widest = 0;
+		for (const LeafSweep& sweep : sweeps)
+			widest = std::max(widest, sweep.hits.size());
+		for (LeafSweep& sweep : sweeps)
+			sweep.resize(int(widest));
+
+		if (with_fixed)
 		{
-			handleCollisionInLeaf(tree.nodes[leafs[int(leafs.size()) - 1 - i]]);
+			const int fixed_count = fixedTree->order.size();
+			resizeWithSlack(fixed_x, fixed_count);
+			resizeWithSlack(fixed_y, fixed_count);
+			resizeWithSlack(fixed_radius, fixed_count);
+			pool.parallelFor(0, fixed_count, [this, scale](int start, int end) {
+				for (int s = start; s < end; s++)
+				{
+					const int j = fixedTree->order[s];
+					fixed_x[s] = bodies.x[j];
+					fixed_y[s] = bodies.y[j];
+					fixed_radius[s] = scale * bodies.radius[j];
+				}
+			});
 		}
+		if (broadphase != Broadphase::GRID || !collectGridContacts(pool, scale, with_fixed))
+			collectTreeContacts(pool, scale, with_fixed);
 
-		for (int i = 0; i < edge_bodies.size(); i++) {
-			handleCollisionForBody(edge_bodies[i], tree.nodes[0]);
+		// Each thread's lists are copied into one place after those of the
+		// threads before it
+		int* owner_offset = scratch.allocate<int>(threads + 1);
+		int* other_offset = scratch.allocate<int>(threads + 1);
+		owner_offset[0] = other_offset[0] = 0;
+		for (int t = 0; t < threads; t++)
+		{
+			owner_offset[t + 1] = owner_offset[t] + int(contact_buffers[t].owner_index.size());
+			other_offset[t + 1] = other_offset[t] + int(contact_buffers[t].other_index.size());
 		}
+		resizeWithSlack(contact_owner, owner_offset[threads]);
+		resizeWithSlack(owner_index, owner_offset[threads]);
+		resizeWithSlack(reference_x, owner_offset[threads]);
+		resizeWithSlack(reference_y, owner_offset[threads]);
+		resizeWithSlack(contact_begin, size_t(owner_offset[threads]) + 1);
+		resizeWithSlack(contact_other, other_offset[threads]);
+		resizeWithSlack(other_index, other_offset[threads]);
+		pool.run([this, owner_offset, other_offset](int thread) {
+			const ContactBuffer& in = contact_buffers[thread];
+			int begin = other_offset[thread];
+			for (size_t k = 0; k < in.owner_index.size(); k++)
+			{
+				const int owner = owner_offset[thread] + int(k), i = in.owner_index[k];
+				owner_index[owner] = i;
+				contact_owner[owner] = bodies.handle(i);
+				reference_x[owner] = bodies.x[i];
+				reference_y[owner] = bodies.y[i];
+				contact_begin[owner] = begin;
+				begin += in.counts[k];
+			}
+			for (size_t c = 0; c < in.other_index.size(); c++)
+			{
+				other_index[other_offset[thread] + c] = in.other_index[c];
+				contact_other[other_offset[thread] + c] = bodies.handle(in.other_index[c]);
+			}
+		});
+		contact_begin[owner_offset[threads]] = other_offset[threads];
+		contacts_layout = bodies.layoutVersion;
+		contacts_membership = bodies.membershipVersion;
+		contacts_tree_begin = tree.bodyBegin;
 	}
 
-	void handleCollisionInLeaf(const Node& node) const {
-		for (int i = node.start; i < node.end - 1; i++) {
-			for (int j = i + 1; j < node.end; j++) {
-				bodies[i].handleCollision(bodies[j]);
+	// Lists the contacts of the bodies of each leaf among the bodies of the
+	// leaf and its neighbours, gathered into one contiguous run per leaf
+	void collectTreeContacts(ThreadPool& pool, float scale, bool with_fixed)
+	{
+		neighbours.resize(pool.size());
+		pool.parallelForDynamic(0, int(tree.nodes.size()), 256, [this, scale, with_fixed](int start, int end, int thread) {
+			ContactBuffer& out = contact_buffers[thread];
+			std::vector<int>& leafs = neighbours[thread];
+			LeafSweep& gathered = sweeps[thread];
+			for (int i = start; i < end; i++)
+			{
+				const Node& node = tree.nodes[i];
+				if (!node.isLeaf() || node.isEmpty())
+					continue;
+				leafs.clear();
+				leafs.push_back(i);
+				collectNeighbours(i, 0, leafs, scale);
+				int total = 0;
+				for (int leaf : leafs)
+					total += tree.nodes[leaf].end - tree.nodes[leaf].start;
+				// With slack, as refitted leaves vary a little from step to step
+				gathered.resize(total + total / 4);
+				int k = 0;
+				for (int leaf : leafs)
+				{
+					for (int slot = tree.nodes[leaf].start; slot < tree.nodes[leaf].end; slot++, k++)
+					{
+						const int j = tree.order[slot];
+						gathered.sorted[k] = j;
+						gathered.x[k] = bodies.x[j];
+						gathered.y[k] = bodies.y[j];
+						gathered.radius[k] = scale * bodies.radius[j];
+					}
+				}
+				for (int slot = node.start; slot < node.end; slot++)
+				{
+					const int index = tree.order[slot];
+					if (!bodies.isEnabled(index))
+						continue;
+					const size_t before = out.other_index.size();
+					collectContacts(index, leafs, scale, gathered, out);
+					if (with_fixed)
+						collectFixedContacts(index, fixedTree->nodes[0], scale, gathered.hits, out);
+					out.owner_index.push_back(index);
+					out.counts.push_back(int(out.other_index.size() - before));
+				}
 			}
+		});
+	}
+
+	// Lists the contacts of each body among the bodies of the nine buckets
+	// around it in a grid widened by scale. Returns false, listing nothing,
+	// when buildGrid does.
+	bool collectGridContacts(ThreadPool& pool, float scale, bool with_fixed)
+	{
+		Grid grid;
+		if (!buildGrid(pool, scale, grid))
+			return false;
+		const int first = tree.bodyBegin, count = tree.bodyCount();
+		const CollisionKernel::FindOverlapsFn findOverlaps = CollisionKernel::get().findOverlaps;
+		pool.parallelForDynamic(0, count, 256, [&](int start, int end, int thread) {
+			ContactBuffer& out = contact_buffers[thread];
+			std::vector<int>& hits = sweeps[thread].hits;
+			for (int i = first + start; i < first + end; i++)
+			{
+				if (!bodies.isEnabled(i))
+					continue;
+				const size_t before = out.other_index.size();
+				const float x = bodies.x[i], y = bodies.y[i];
+				uint32_t buckets[9];
+				const int bucket_count = gridBuckets(grid, x, y, buckets);
+				for (int n = 0; n < bucket_count; n++)
+				{
+					const int begin = grid.bucket_begin[buckets[n]], size = grid.bucket_begin[buckets[n] + 1] - begin;
+					if (int(hits.size()) < size)
+						hits.resize(size);
+					const int found = findOverlaps(&grid.x[begin], &grid.y[begin], &grid.radius[begin], size,
+						x, y, scale * bodies.radius[i], hits.data());
+					for (int h = 0; h < found; h++)
+					{
+						const int j = grid.sorted[begin + hits[h]];
+						if (j != i)
+							out.other_index.push_back(j);
+					}
+				}
+				if (with_fixed)
+					collectFixedContacts(i, fixedTree->nodes[0], scale, hits, out);
+				out.owner_index.push_back(i);
+				out.counts.push_back(int(out.other_index.size() - before));
+			}
+		});
+		return true;
+	}
+
+	// Points the lists at the current indices of their bodies
+	void remapContacts(ThreadPool& pool)
+	{
+		pool.parallelFor(0, contact_owner.size(), [this](int start, int end) {
+			for (int k = start; k < end; k++)
+			{
+				owner_index[k] = bodies.indexOf(contact_owner[k]);
+				for (int c = contact_begin[k]; c < contact_begin[k + 1]; c++)
+					other_index[c] = bodies.indexOf(contact_other[c]);
+			}
+		});
+		contacts_layout = bodies.layoutVersion;
+	}
+
+	// Whether any body has moved further than its margin since the lists
+	// were built
+	bool contactsMovedOut(ThreadPool& pool)
+	{
+		const int threads = pool.size(), count = contact_owner.size();
+		uint8_t* moved = scratch.allocate<uint8_t>(threads);
+		pool.run([this, threads, count, moved](int thread) {
+			bool any = false;
+			for (int k = int(1LL * count * thread / threads); k < int(1LL * count * (thread + 1) / threads); k++)
+			{
+				const int i = owner_index[k];
+				if (i < 0)
+					continue;
+				const float dx = bodies.x[i] - reference_x[k], dy = bodies.y[i] - reference_y[k];
+				const float margin = contactMargin * bodies.radius[i];
+				any = any || !(dx * dx + dy * dy <= margin * margin);
+			}
+			moved[thread] = any;
+		});
+		return std::find(moved, moved + threads, 1) != moved + threads;
+	}
+
+	// Resolves the pairs of the leaf's bodies that overlap. Their squared
+	// distances are tested several at a time by CollisionKernel, and only
+	// the pairs that touch reach Bodies::handleCollision, in the order of a
+	// plain loop over the slots.
+	//
+	// Leaves of up to sweepLeafSize bodies test every pair, resolving them
+	// as they are found. Larger leaves, such as those at the tree's depth
+	// limit, first sort their bodies along x and sweep them: only bodies
+	// closer in x than the two largest radii are tested. The pairs found
+	// are then sorted back into slot order and resolved, each tested again
+	// against the current positions. A pair pushed into contact by the
+	// pairs before it is left for the next pass.
+	void handleCollisionInLeaf(const Node& node, int thread)
+	{
+		const int count = node.end - node.start;
+		if (count < 2)
+			return;
+		LeafSweep& sweep = sweeps[thread];
+		sweep.resize(count);
+		const CollisionKernel::FindOverlapsFn findOverlaps = CollisionKernel::get().findOverlaps;
+		if (count <= sweepLeafSize)
+		{
+			for (int k = 0; k < count; k++)
+			{
+				const int i = tree.order[node.start + k];
+				sweep.x[k] = bodies.x[i];
+				sweep.y[k] = bodies.y[i];
+				sweep.radius[k] = bodies.radius[i];
+			}
+			for (int a = 0; a < count - 1; a++)
+			{
+				const int hits = findOverlaps(&sweep.x[a + 1], &sweep.y[a + 1], &sweep.radius[a + 1], count - a - 1,
+					sweep.x[a], sweep.y[a], sweep.radius[a], sweep.hits.data());
+				const int i = tree.order[node.start + a];
+				for (int h = 0; h < hits; h++)
+				{
+					const int b = a + 1 + sweep.hits[h], j = tree.order[node.start + b];
+					bodies.handleCollision(i, j);
+					sweep.x[b] = bodies.x[j];
+					sweep.y[b] = bodies.y[j];
+				}
+			}
+			return;
+		}
+		// Sorted as integers, each x with the slot offset in its low bits
+		float max_radius = 0;
+		for (int k = 0; k < count; k++)
+		{
+			const int i = tree.order[node.start + k];
+			// NaN sorts last and then never passes the sweep bound
+			sweep.key[k] = uint64_t(sortableBits(std::isnan(bodies.x[i]) ? INFINITY : bodies.x[i])) << 32 | uint32_t(k);
+			max_radius = std::max(max_radius, bodies.radius[i]);
 		}
+		std::sort(sweep.key.begin(), sweep.key.begin() + count);
+		for (int k = 0; k < count; k++)
+			sweep.sorted[k] = int(sweep.key[k] & 0xFFFFFFFF);
+		for (int k = 0; k < count; k++)
+		{
+			const int i = tree.order[node.start + sweep.sorted[k]];
+			sweep.x[k] = bodies.x[i];
+			sweep.y[k] = bodies.y[i];
+			sweep.radius[k] = bodies.radius[i];
+		}
+
+		sweep.pairs.clear();
+		for (int a = 0; a < count - 1; a++)
+		{
+			const float bound = sweep.x[a] + sweep.radius[a] + max_radius;
+			int end = a + 1;
+			while (end < count && sweep.x[end] <= bound)
+				end++;
+			const int hits = findOverlaps(&sweep.x[a + 1], &sweep.y[a + 1], &sweep.radius[a + 1], end - a - 1,
+				sweep.x[a], sweep.y[a], sweep.radius[a], sweep.hits.data());
+			for (int h = 0; h < hits; h++)
+			{
+				const uint32_t p = sweep.sorted[a], q = sweep.sorted[a + 1 + sweep.hits[h]];
+				sweep.pairs.push_back(p < q ? uint64_t(p) << 32 | q : uint64_t(q) << 32 | p);
+			}
+		}
+		std::sort(sweep.pairs.begin(), sweep.pairs.end());
+		for (uint64_t pair : sweep.pairs)
+			bodies.handleCollision(tree.order[node.start + int(pair >> 32)], tree.order[node.start + int(pair & 0xFFFFFFFF)]);
 	}
 
-	void handleCollisionForBody(int index, const Node& node) const
+	// Resolves body `index` against the fixed bodies of `node` in fixedTree.
+	// The fixed body is passed first, so only `index` is pushed away.
+	void handleFixedCollisions(int index, const Node& node) const
 	{
-		Body& body = bodies[index];
-		if (node.isEmpty() || node.distanceFromBody(bodies[index]) > (body.radius + node.maxRadius))
+		if (node.isEmpty() || node.distanceFromPoint(bodies.x[index], bodies.y[index]) > (bodies.radius[index] + node.maxRadius))
 			return;
 		if (node.isLeaf())
 		{
-			if (node.start <= index && index < node.end)
+			for (int i = node.start; i < node.end; i++)
+				bodies.handleCollision(fixedTree->order[i], index);
+			return;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			handleFixedCollisions(index, fixedTree->nodes[node.children + i]);
+		}
+	}
+
+	// Appends the non-empty leaves below `node`, other than `leaf`, that a
+	// body of `leaf` may touch. A body lies within maxRadius of its leaf's
+	// box, refitted leaves included, so two boxes further apart than the
+	// sum of their maxRadius hold no touching pair, `scale` widens that.
+	void collectNeighbours(int leaf, int node, std::vector<int>& out, float scale = 1) const
+	{
+		const Node& a = tree.nodes[leaf];
+		const Node& b = tree.nodes[node];
+		if (node == leaf || b.isEmpty())
+			return;
+		const float dx = std::max(0.0f, std::max(a.top_left.x - b.bottom_right.x, b.top_left.x - a.bottom_right.x));
+		const float dy = std::max(0.0f, std::max(a.top_left.y - b.bottom_right.y, b.top_left.y - a.bottom_right.y));
+		const float reach = scale * (a.maxRadius + b.maxRadius);
+		if (dx * dx + dy * dy > reach * reach)
+			return;
+		if (b.isLeaf())
+		{
+			out.push_back(node);
+			return;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			collectNeighbours(leaf, b.children + i, out, scale);
+		}
+	}
+
+	// Adds the pushes the body in tree slot `slot` gets from the bodies of
+	// the neighbouring leaves
+	void sumCrossLeafPushes(int slot, const std::vector<int>& leafs, float& push_x, float& push_y) const
+	{
+		const int index = tree.order[slot];
+		for (int leaf : leafs)
+		{
+			const Node& node = tree.nodes[leaf];
+			if (node.distanceFromPoint(bodies.x[index], bodies.y[index]) > (bodies.radius[index] + node.maxRadius))
+				continue;
+			for (int i = node.start; i < node.end; i++)
+				bodies.addCollisionPush(index, tree.order[i], push_x, push_y);
+		}
+	}
+
+private:
+	// Neighbouring leaves of the leaf each thread is working on
+	std::vector<std::vector<int>> neighbours;
+
+	// The bodies of the leaf a thread is sweeping, in x order, and the
+	// overlapping pairs found, as the two slot offsets. The contact refresh
+	// gathers the bodies of a leaf's neighbourhood here, sorted holding
+	// their indices.
+	struct LeafSweep
+	{
+		std::vector<int> sorted, hits;
+		std::vector<float> x, y, radius;
+		std::vector<uint64_t> key, pairs;
+
+		void resize(int count)
+		{
+			for (std::vector<int>* v : { &sorted, &hits })
 			{
-				for (int i = node.start; i < index; i++)
-					body.handleCollision(bodies[i]);
-				for (int i = index + 1; i < node.end; i++)
-					body.handleCollision(bodies[i]);
+				if (int(v->size()) < count)
+					v->resize(count);
 			}
-			else
+			for (std::vector<float>* v : { &x, &y, &radius })
 			{
-				for (int i = node.start; i < node.end; i++)
-					body.handleCollision(bodies[i]);
+				if (int(v->size()) < count)
+					v->resize(count);
 			}
+			if (int(key.size()) < count)
+				key.resize(count);
+		}
+	};
+	std::vector<LeafSweep> sweeps;
+
+	// Contact lists one thread built, in the order of their bodies
+	struct ContactBuffer
+	{
+		std::vector<int> owner_index, counts, other_index;
+
+		void clear(size_t owners, size_t others)
+		{
+			owner_index.clear();
+			counts.clear();
+			other_index.clear();
+			owner_index.reserve(owners + owners / 4);
+			counts.reserve(owners + owners / 4);
+			other_index.reserve(others + others / 4);
+		}
+	};
+	std::vector<ContactBuffer> contact_buffers;
+	// The contacts of the body contact_owner[k] are contact_other in
+	// [contact_begin[k], contact_begin[k + 1]). The indices are those of
+	// layout contacts_layout, -1 for bodies that are gone.
+	std::vector<BodyHandle> contact_owner, contact_other;
+	std::vector<int> owner_index, other_index, contact_begin;
+	// Position of every owner when its list was built
+	std::vector<float> reference_x, reference_y;
+	// Fixed bodies in fixedTree slot order, radii scaled by the margin
+	std::vector<float> fixed_x, fixed_y, fixed_radius;
+	uint64_t contacts_layout = 0;
+	uint64_t contacts_membership = ~0ull;
+	int contacts_tree_begin = 0;
+
+	// Appends the bodies of `leafs`, other than `index`, that lie within
+	// scale times the summed radii of `index`. `gathered` holds the bodies
+	// of `leafs` one leaf after another, with their radii scaled.
+	void collectContacts(int index, const std::vector<int>& leafs, float scale, LeafSweep& gathered, ContactBuffer& out) const
+	{
+		const CollisionKernel::FindOverlapsFn findOverlaps = CollisionKernel::get().findOverlaps;
+		const float x = bodies.x[index], y = bodies.y[index], r = bodies.radius[index];
+		int run = 0;
+		for (int leaf : leafs)
+		{
+			const Node& node = tree.nodes[leaf];
+			const int begin = run, size = node.end - node.start;
+			run += size;
+			if (node.distanceFromPoint(x, y) > scale * (r + node.maxRadius))
+				continue;
+			const int found = findOverlaps(&gathered.x[begin], &gathered.y[begin], &gathered.radius[begin], size,
+				x, y, scale * r, gathered.hits.data());
+			for (int h = 0; h < found; h++)
+			{
+				const int j = gathered.sorted[begin + gathered.hits[h]];
+				if (j != index)
+					out.other_index.push_back(j);
+			}
+		}
+	}
+
+	// collectContacts for the fixed bodies below `node` in fixedTree, read
+	// from fixed_x, fixed_y and fixed_radius
+	void collectFixedContacts(int index, const Node& node, float scale, std::vector<int>& hits, ContactBuffer& out) const
+	{
+		const float x = bodies.x[index], y = bodies.y[index], r = bodies.radius[index];
+		if (node.isEmpty() || node.distanceFromPoint(x, y) > scale * (r + node.maxRadius))
+			return;
+		if (node.isLeaf())
+		{
+			const int size = node.end - node.start;
+			if (int(hits.size()) < size)
+				hits.resize(size);
+			const int found = CollisionKernel::get().findOverlaps(&fixed_x[node.start], &fixed_y[node.start], &fixed_radius[node.start], size,
+				x, y, scale * r, hits.data());
+			for (int h = 0; h < found; h++)
+				out.other_index.push_back(fixedTree->order[node.start + hits[h]]);
 			return;
 		}
 
 		for (int i = 0; i < 4; i++)
 		{
-			handleCollisionForBody(index, tree.nodes[node.children + i]);
+			collectFixedContacts(index, fixedTree->nodes[node.children + i], scale, hits, out);
 		}
 	}
-};
\ No newline at end of file
+
+	// The bits of v as an unsigned integer that orders like v
+	static uint32_t sortableBits(float v)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &v, sizeof(bits));
+		return bits & 0x80000000 ? ~bits : bits | 0x80000000;
+	}
+
+	// The distinct buckets of the cell of (x, y) and the eight around it
+	static int gridBuckets(const Grid& grid, float x, float y, uint32_t* out)
+	{
+		const int64_t cx = cellOf(x, grid.inverse_cell), cy = cellOf(y, grid.inverse_cell);
+		int count = 0;
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			for (int dx = -1; dx <= 1; dx++)
+			{
+				const uint32_t b = cellHash(cx + dx, cy + dy) & grid.mask;
+				// Two of the cells may share a bucket
+				if (std::find(out, out + count, b) == out + count)
+					out[count++] = b;
+			}
+		}
+		return count;
+	}
+
+	// Grid coordinate, clamped so that far outliers cannot overflow
+	static int64_t cellOf(float v, float inverse_cell)
+	{
+		const double c = std::floor(double(v) * inverse_cell);
+		return int64_t(std::max(-1e15, std::min(c, 1e15)));
+	}
+
+	// Buckets are sorted in two passes, by 2^COARSE_BITS ranges first
+	static constexpr int COARSE_BITS = 8;
+
+	// Interleaves the low bits of the cell coordinates. The table then
+	// wraps around like a torus: nearby cells land in nearby buckets, and
+	// cells that share a bucket are far apart and filtered by distance.
+	static uint32_t cellHash(int64_t cx, int64_t cy)
+	{
+		return uint32_t(QuadTree::spreadBits(uint32_t(cy) & 0xFFFF) << 1 | QuadTree::spreadBits(uint32_t(cx) & 0xFFFF));
+	}
+};
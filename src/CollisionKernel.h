@@ -0,0 +1,135 @@
+#pragma once
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLLISION_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define COLLISION_KERNEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Overlap test kernels: writes to hits the index of every candidate i
+// with (sx - x)^2 + (sy - y)^2 <= (sr + r)^2 and returns how many there
+// are. Only squared distances are compared, so the candidates that do not
+// touch, usually most of them, never take a square root.
+//
+// The widest kernel the CPU supports is picked once at startup.
+namespace CollisionKernel
+{
+	typedef int (*FindOverlapsFn)(const float* sx, const float* sy, const float* sr, int n,
+		float x, float y, float r, int* hits);
+
+	inline int findOverlapsScalar(const float* sx, const float* sy, const float* sr, int n,
+		float x, float y, float r, int* hits)
+	{
+		int count = 0;
+		for (int i = 0; i < n; i++)
+		{
+			float dx = sx[i] - x, dy = sy[i] - y, reach = sr[i] + r;
+			if (dx * dx + dy * dy <= reach * reach)
+				hits[count++] = i;
+		}
+		return count;
+	}
+
+#ifdef COLLISION_KERNEL_X86
+	__attribute__((target("avx2")))
+	inline int findOverlapsAvx2(const float* sx, const float* sy, const float* sr, int n,
+		float x, float y, float r, int* hits)
+	{
+		const __m256 px = _mm256_set1_ps(x), py = _mm256_set1_ps(y), pr = _mm256_set1_ps(r);
+		int count = 0, i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(sx + i), px);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(sy + i), py);
+			__m256 reach = _mm256_add_ps(_mm256_loadu_ps(sr + i), pr);
+			__m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+			unsigned mask = _mm256_movemask_ps(_mm256_cmp_ps(d2, _mm256_mul_ps(reach, reach), _CMP_LE_OQ));
+			for (; mask; mask &= mask - 1)
+				hits[count++] = i + __builtin_ctz(mask);
+		}
+		const int tail = findOverlapsScalar(sx + i, sy + i, sr + i, n - i, x, y, r, hits + count);
+		for (int j = count; j < count + tail; j++)
+			hits[j] += i;
+		return count + tail;
+	}
+
+	// The last partial block is loaded under a mask, so no scalar tail is left
+	__attribute__((target("avx512f")))
+	inline int findOverlapsAvx512(const float* sx, const float* sy, const float* sr, int n,
+		float x, float y, float r, int* hits)
+	{
+		const __m512 px = _mm512_set1_ps(x), py = _mm512_set1_ps(y), pr = _mm512_set1_ps(r);
+		int count = 0;
+		for (int i = 0; i < n; i += 16)
+		{
+			const __mmask16 lanes = n - i >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (n - i)) - 1);
+			__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, sx + i), px);
+			__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, sy + i), py);
+			__m512 reach = _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, sr + i), pr);
+			__m512 d2 = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+			unsigned mask = _mm512_mask_cmp_ps_mask(lanes, d2, _mm512_mul_ps(reach, reach), _CMP_LE_OQ);
+			for (; mask; mask &= mask - 1)
+				hits[count++] = i + __builtin_ctz(mask);
+		}
+		return count;
+	}
+#endif
+
+#ifdef COLLISION_KERNEL_NEON
+	inline int findOverlapsNeon(const float* sx, const float* sy, const float* sr, int n,
+		float x, float y, float r, int* hits)
+	{
+		const float32x4_t px = vdupq_n_f32(x), py = vdupq_n_f32(y), pr = vdupq_n_f32(r);
+		int count = 0, i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			float32x4_t dx = vsubq_f32(vld1q_f32(sx + i), px);
+			float32x4_t dy = vsubq_f32(vld1q_f32(sy + i), py);
+			float32x4_t reach = vaddq_f32(vld1q_f32(sr + i), pr);
+			float32x4_t d2 = vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy));
+			uint32_t lanes[4];
+			vst1q_u32(lanes, vcleq_f32(d2, vmulq_f32(reach, reach)));
+			for (int j = 0; j < 4; j++)
+			{
+				if (lanes[j])
+					hits[count++] = i + j;
+			}
+		}
+		const int tail = findOverlapsScalar(sx + i, sy + i, sr + i, n - i, x, y, r, hits + count);
+		for (int j = count; j < count + tail; j++)
+			hits[j] += i;
+		return count + tail;
+	}
+#endif
+
+	struct Kernel
+	{
+		FindOverlapsFn findOverlaps;
+		const char* name;
+	};
+
+	inline Kernel detect()
+	{
+#ifdef COLLISION_KERNEL_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return { findOverlapsAvx512, "avx512" };
+		if (__builtin_cpu_supports("avx2"))
+			return { findOverlapsAvx2, "avx2" };
+#endif
+#ifdef COLLISION_KERNEL_NEON
+		return { findOverlapsNeon, "neon" };
+#endif
+		return { findOverlapsScalar, "scalar" };
+	}
+
+	inline const Kernel& get()
+	{
+		static const Kernel kernel = detect();
+		return kernel;
+	}
+}
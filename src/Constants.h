@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+
+namespace Constants
+{
+	const float G = 6.67e-11f;
+	const int FPS = 60;
+	const float dt = 0.005f;
+	const float PI = 3.1415;
+
+	float CURRENT_FPS = 0.0f;
+	std::string mode = "CIRCLE";
+}
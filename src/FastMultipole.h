@@ -0,0 +1,441 @@
+#pragma once
+#include "Body.h"
+#include "QuadTree.h"
+#include "ThreadPool.h"
+#include <SFML/System/Vector2.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Fast multipole solver on the QuadTree node hierarchy. The kernel is the
+// same m / d^3 force BarnesHut uses (a 1/r potential in the plane), which
+// is not the 2D log kernel, so the expansions are Cartesian Taylor series
+// of 1/r instead of complex power series:
+//
+//   multipole  M[a] = sum m * (s - c)^a / a!                about the box centre c
+//   local      L[b] = sum_a (-1)^|a| M[a] * D^(a+b)(z - c)  about the box centre z
+//
+// with |a| + |b| <= order and D the partial derivatives of 1/r. Pairs of
+// nodes are matched with a dual tree traversal: well separated pairs use
+// M2L, touching leaves use P2P. The near field follows BarnesHut: bodies
+// in the same leaf do not attract each other, that range is left to the
+// collision handler, and sources closer than eps are skipped. There is no
+// other softening, so both solvers approximate the same direct sum.
+//
+// Every pass runs on the pool. The upward and downward passes go one tree
+// level at a time, like QuadTree::calculateCenterMass, and the traversal
+// one round of node pairs at a time, so none depends on the thread count.
+class FastMultipole
+{
+public:
+	Bodies& bodies;
+	QuadTree& tree;
+	// Expansion order; the error falls roughly like openingAngle^(order + 1)
+	int order = 4;
+	// Two nodes interact through M2L when (r_a + r_b) < openingAngle * distance
+	float openingAngle = 0.5f;
+	// Sources closer than this are skipped, kept equal to BarnesHut::eps
+	float eps = 0.0001;
+
+	FastMultipole(Bodies& bodies, QuadTree& tree) : bodies(bodies), tree(tree) {}
+
+	void applyGravity(ThreadPool& pool)
+	{
+		if (tree.nodes.empty())
+			return;
+		prepareTables();
+		const int node_count = tree.nodes.size();
+		resizeWithSlack(multipoles, size_t(node_count) * terms);
+		resizeWithSlack(locals, size_t(node_count) * terms);
+		std::fill(multipoles.begin(), multipoles.end(), 0.0);
+		std::fill(locals.begin(), locals.end(), 0.0);
+
+		upwardPass(pool);
+
+		interact(pool);
+		groupByTarget(m2l_pairs, m2l_offsets, m2l_sources, node_count);
+		groupByTarget(p2p_pairs, p2p_offsets, p2p_sources, node_count);
+
+		pool.parallelForDynamic(0, node_count, 64, [this](int start, int end, int) {
+			double derivatives[MAX_TERMS];
+			for (int i = start; i < end; i++)
+			{
+				for (int k = m2l_offsets[i]; k < m2l_offsets[i + 1]; k++)
+					m2l(m2l_sources[k], i, derivatives);
+			}
+		});
+
+		downwardPass(pool);
+
+		leafs.clear();
+		for (int i = 0; i < node_count; i++)
+		{
+			if (tree.nodes[i].isLeaf() && !tree.nodes[i].isEmpty())
+				leafs.push_back(i);
+		}
+		pool.parallelForDynamic(0, leafs.size(), 16, [this](int start, int end, int) {
+			double powers[MAX_TERMS];
+			for (int i = start; i < end; i++)
+				evaluateLeaf(leafs[i], powers);
+		});
+	}
+
+private:
+	struct M2LTerm
+	{
+		int local, multipole, derivative;
+		double sign;
+	};
+	struct ShiftTerm
+	{
+		int to, from, shift;
+	};
+
+	static constexpr int MAX_ORDER = 12;
+	static constexpr int MAX_TERMS = (MAX_ORDER + 1) * (MAX_ORDER + 2) / 2;
+
+	int prepared_order = -1;
+	int terms = 0;
+	std::vector<double> factorials;
+	std::vector<M2LTerm> m2l_terms;
+	std::vector<ShiftTerm> m2m_terms, l2l_terms;
+
+	std::vector<double> multipoles, locals;
+	std::vector<std::pair<int, int>> m2l_pairs, p2p_pairs;
+	// Node pairs of the current traversal round, and what one thread found
+	// for its share of them
+	std::vector<std::pair<int, int>> frontier;
+	struct Traversal
+	{
+		std::vector<std::pair<int, int>> next, m2l, p2p;
+	};
+	std::vector<Traversal> traversals;
+	std::vector<int> m2l_offsets, m2l_sources, p2p_offsets, p2p_sources;
+	std::vector<int> leafs;
+
+	// Coefficients are stored by total degree n = a + b, then by b
+	static int index(int a, int b)
+	{
+		int n = a + b;
+		return n * (n + 1) / 2 + b;
+	}
+
+	void prepareTables()
+	{
+		order = std::max(1, std::min(order, MAX_ORDER));
+		if (prepared_order == order)
+			return;
+		prepared_order = order;
+		terms = (order + 1) * (order + 2) / 2;
+
+		factorials.assign(order + 1, 1.0);
+		for (int i = 1; i < factorials.size(); i++)
+			factorials[i] = factorials[i - 1] * i;
+
+		m2l_terms.clear();
+		m2m_terms.clear();
+		l2l_terms.clear();
+		for (int na = 0; na <= order; na++)
+		{
+			for (int ba = 0; ba <= na; ba++)
+			{
+				int aa = na - ba;
+				for (int nb = 0; na + nb <= order; nb++)
+				{
+					for (int bb = 0; bb <= nb; bb++)
+					{
+						int ab = nb - bb;
+						m2l_terms.push_back({ index(ab, bb), index(aa, ba), index(aa + ab, ba + bb), (na % 2) ? -1.0 : 1.0 });
+						// M2M: M_parent[a + b] += M_child[a] * t^b / b!
+						m2m_terms.push_back({ index(aa + ab, ba + bb), index(aa, ba), index(ab, bb) });
+						// L2L: L_child[a] += L_parent[a + b] * t^b / b!
+						l2l_terms.push_back({ index(aa, ba), index(aa + ab, ba + bb), index(ab, bb) });
+					}
+				}
+			}
+		}
+	}
+
+	// out[index(a, b)] = dx^a dy^b / (a! b!) for a + b <= max_order
+	void scaledPowers(double dx, double dy, int max_order, double* out) const
+	{
+		out[0] = 1.0;
+		for (int n = 1; n <= max_order; n++)
+		{
+			for (int b = 0; b <= n; b++)
+			{
+				int a = n - b;
+				out[index(a, b)] = (a > 0) ? out[index(a - 1, b)] * dx / a : out[index(a, b - 1)] * dy / b;
+			}
+		}
+	}
+
+	// out[index(a, b)] = d^a/dx^a d^b/dy^b 1/r at (x, y). The Taylor
+	// coefficients T = D / (a! b!) follow the recurrence
+	//   n r^2 T[a, b] = -(2n - 1)(x T[a-1, b] + y T[a, b-1]) - (n - 1)(T[a-2, b] + T[a, b-2])
+	void derivatives(double x, double y, double* out) const
+	{
+		const double inv_r2 = 1.0 / (x * x + y * y);
+		out[0] = std::sqrt(inv_r2);
+		for (int n = 1; n <= order; n++)
+		{
+			const double c1 = -(2 * n - 1) * inv_r2 / n, c2 = -(n - 1) * inv_r2 / n;
+			for (int b = 0; b <= n; b++)
+			{
+				int a = n - b;
+				double t = 0;
+				if (a > 0)
+					t += c1 * x * out[index(a - 1, b)];
+				if (b > 0)
+					t += c1 * y * out[index(a, b - 1)];
+				if (a > 1)
+					t += c2 * out[index(a - 2, b)];
+				if (b > 1)
+					t += c2 * out[index(a, b - 2)];
+				out[index(a, b)] = t;
+			}
+		}
+		for (int n = 2; n <= order; n++)
+		{
+			for (int b = 0; b <= n; b++)
+				out[index(n - b, b)] *= factorials[n - b] * factorials[b];
+		}
+	}
+
+	sf::Vector2f boxCenter(const Node& node) const
+	{
+		return (node.top_left + node.bottom_right) / 2.0f;
+	}
+
+	float boxRadius(const Node& node) const
+	{
+		return (node.bottom_right.x - node.top_left.x) * 0.70710678f;
+	}
+
+	void upwardPass(ThreadPool& pool)
+	{
+		pool.parallelForDynamic(0, tree.nodes.size(), 64, [this](int start, int end, int) {
+			double powers[MAX_TERMS];
+			for (int i = start; i < end; i++)
+			{
+				const Node& node = tree.nodes[i];
+				if (!node.isLeaf() || node.isEmpty())
+					continue;
+				const sf::Vector2f c = boxCenter(node);
+				double* M = &multipoles[size_t(i) * terms];
+				for (int slot = node.start; slot < node.end; slot++)
+				{
+					const int j = tree.order[slot];
+					scaledPowers(double(bodies.x[j]) - c.x, double(bodies.y[j]) - c.y, order, powers);
+					for (int t = 0; t < terms; t++)
+						M[t] += bodies.mass[j] * powers[t];
+				}
+			}
+		});
+
+		for (int level = tree.levelCount() - 2; level >= 0; level--)
+		{
+			pool.parallelFor(tree.levelBegin(level), tree.levelBegin(level + 1), [this](int start, int end) {
+				double powers[MAX_TERMS];
+				for (int i = start; i < end; i++)
+				{
+					const Node& node = tree.nodes[i];
+					if (node.isLeaf() || node.isEmpty())
+						continue;
+					const sf::Vector2f c = boxCenter(node);
+					double* M = &multipoles[size_t(i) * terms];
+					for (int child = node.children; child != node.next; child = tree.nodes[child].next)
+					{
+						if (tree.nodes[child].isEmpty())
+							continue;
+						const sf::Vector2f cc = boxCenter(tree.nodes[child]);
+						scaledPowers(double(cc.x) - c.x, double(cc.y) - c.y, order, powers);
+						const double* MC = &multipoles[size_t(child) * terms];
+						for (const ShiftTerm& s : m2m_terms)
+							M[s.to] += MC[s.from] * powers[s.shift];
+					}
+				}
+			});
+		}
+	}
+
+	// Dual tree traversal, records which node pairs interact and how. Each
+	// round every thread takes a contiguous share of the pairs left open by
+	// the round before, and the threads' results are appended in thread
+	// order, so the pairs are listed in the same order for any thread count.
+	void interact(ThreadPool& pool)
+	{
+		const int threads = pool.size();
+		traversals.resize(threads);
+		m2l_pairs.clear();
+		p2p_pairs.clear();
+		frontier.clear();
+		frontier.push_back({ 0, 0 });
+		while (!frontier.empty())
+		{
+			const int count = frontier.size();
+			pool.run([this, count, threads](int thread) {
+				Traversal& out = traversals[thread];
+				out.next.clear();
+				out.m2l.clear();
+				out.p2p.clear();
+				for (int k = int(1LL * count * thread / threads); k < int(1LL * count * (thread + 1) / threads); k++)
+					interactPair(frontier[k].first, frontier[k].second, out);
+			});
+			frontier.clear();
+			for (const Traversal& t : traversals)
+			{
+				append(frontier, t.next);
+				append(m2l_pairs, t.m2l);
+				append(p2p_pairs, t.p2p);
+			}
+		}
+	}
+
+	// Appends from to to, with the headroom of resizeWithSlack. insert
+	// grows an emptied vector to fit exactly, every step it comes out larger.
+	static void append(std::vector<std::pair<int, int>>& to, const std::vector<std::pair<int, int>>& from)
+	{
+		const size_t size = to.size();
+		resizeWithSlack(to, size + from.size());
+		std::copy(from.begin(), from.end(), to.begin() + size);
+	}
+
+	// Records the pair as M2L or P2P, or opens the larger node into the
+	// pairs of the next round
+	void interactPair(int target, int source, Traversal& out) const
+	{
+		const Node& a = tree.nodes[target];
+		const Node& b = tree.nodes[source];
+		if (a.isEmpty() || b.isEmpty())
+			return;
+
+		const sf::Vector2f ca = boxCenter(a), cb = boxCenter(b);
+		const float dx = ca.x - cb.x, dy = ca.y - cb.y;
+		const float ra = boxRadius(a), rb = boxRadius(b);
+		if (target != source && (ra + rb) * (ra + rb) < openingAngle * openingAngle * (dx * dx + dy * dy))
+		{
+			out.m2l.push_back({ target, source });
+			return;
+		}
+		if (a.isLeaf() && b.isLeaf())
+		{
+			if (target != source)
+				out.p2p.push_back({ target, source });
+			return;
+		}
+		if (b.isLeaf() || (!a.isLeaf() && ra >= rb))
+		{
+			for (int child = a.children; child != a.next; child = tree.nodes[child].next)
+				out.next.push_back({ child, source });
+		}
+		else
+		{
+			for (int child = b.children; child != b.next; child = tree.nodes[child].next)
+				out.next.push_back({ target, child });
+		}
+	}
+
+	// Counting sort of (target, source) pairs into per-target source lists
+	void groupByTarget(const std::vector<std::pair<int, int>>& pairs, std::vector<int>& offsets, std::vector<int>& sources, int node_count) const
+	{
+		resizeWithSlack(offsets, node_count + 1);
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for (const std::pair<int, int>& p : pairs)
+			offsets[p.first + 1]++;
+		for (int i = 0; i < node_count; i++)
+			offsets[i + 1] += offsets[i];
+		resizeWithSlack(sources, pairs.size());
+		for (const std::pair<int, int>& p : pairs)
+			sources[offsets[p.first]++] = p.second;
+		// Each offset now holds the next one's old value
+		for (int i = node_count; i > 0; i--)
+			offsets[i] = offsets[i - 1];
+		offsets[0] = 0;
+	}
+
+	void m2l(int source, int target, double* D)
+	{
+		const sf::Vector2f cs = boxCenter(tree.nodes[source]), ct = boxCenter(tree.nodes[target]);
+		derivatives(double(ct.x) - cs.x, double(ct.y) - cs.y, D);
+		const double* M = &multipoles[size_t(source) * terms];
+		double* L = &locals[size_t(target) * terms];
+		for (const M2LTerm& t : m2l_terms)
+			L[t.local] += t.sign * M[t.multipole] * D[t.derivative];
+	}
+
+	// L2L one level at a time from the root, each parent writing only its
+	// own children
+	void downwardPass(ThreadPool& pool)
+	{
+		for (int level = 0; level < tree.levelCount() - 1; level++)
+		{
+			pool.parallelFor(tree.levelBegin(level), tree.levelBegin(level + 1), [this](int start, int end) {
+				double powers[MAX_TERMS];
+				for (int i = start; i < end; i++)
+				{
+					const Node& node = tree.nodes[i];
+					if (node.isLeaf() || node.isEmpty())
+						continue;
+					const sf::Vector2f c = boxCenter(node);
+					const double* L = &locals[size_t(i) * terms];
+					for (int child = node.children; child != node.next; child = tree.nodes[child].next)
+					{
+						if (tree.nodes[child].isEmpty())
+							continue;
+						const sf::Vector2f cc = boxCenter(tree.nodes[child]);
+						scaledPowers(double(cc.x) - c.x, double(cc.y) - c.y, order, powers);
+						double* LC = &locals[size_t(child) * terms];
+						for (const ShiftTerm& s : l2l_terms)
+							LC[s.to] += L[s.from] * powers[s.shift];
+					}
+				}
+			});
+		}
+	}
+
+	// L2P for every body of the leaf, then P2P against the touching leaves
+	void evaluateLeaf(int leaf_index, double* powers) const
+	{
+		const Node& leaf = tree.nodes[leaf_index];
+		const sf::Vector2f c = boxCenter(leaf);
+		const double* L = &locals[size_t(leaf_index) * terms];
+		const double eps2 = double(eps) * eps;
+
+		for (int slot = leaf.start; slot < leaf.end; slot++)
+		{
+			const int i = tree.order[slot];
+			if (bodies.isFixed(i) || !bodies.isEnabled(i))
+				continue;
+			scaledPowers(double(bodies.x[i]) - c.x, double(bodies.y[i]) - c.y, order - 1, powers);
+			double ax = 0, ay = 0;
+			for (int n = 0; n < order; n++)
+			{
+				for (int b = 0; b <= n; b++)
+				{
+					int a = n - b;
+					ax += L[index(a + 1, b)] * powers[index(a, b)];
+					ay += L[index(a, b + 1)] * powers[index(a, b)];
+				}
+			}
+
+			for (int k = p2p_offsets[leaf_index]; k < p2p_offsets[leaf_index + 1]; k++)
+			{
+				const Node& source = tree.nodes[p2p_sources[k]];
+				for (int source_slot = source.start; source_slot < source.end; source_slot++)
+				{
+					const int j = tree.order[source_slot];
+					double dx = double(bodies.x[j]) - bodies.x[i], dy = double(bodies.y[j]) - bodies.y[i];
+					double d2 = dx * dx + dy * dy;
+					if (d2 < eps2)
+						continue;
+					double s = bodies.mass[j] / (d2 * std::sqrt(d2));
+					ax += s * dx;
+					ay += s * dy;
+				}
+			}
+			bodies.ax[i] = float(ax * Constants::G);
+			bodies.ay[i] = float(ay * Constants::G);
+		}
+	}
+};
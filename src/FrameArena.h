@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Bump allocator for scratch buffers that only live until the next reset(),
+// typically one phase of a step. Everything handed out since the last
+// reset is released at once, and the block is then resized to the largest
+// amount a phase has needed so far. After the first steps a phase
+// therefore takes all of its scratch memory from one block that is already
+// mapped and touched, without any heap allocation. Requests that do not fit
+// yet are served from the heap until the next reset.
+//
+// On Linux the block is mapped directly and marked for transparent huge
+// pages, which saves TLB misses in scattered accesses over large buffers
+// such as the radix sort's.
+//
+// allocate() may be called from several threads at once. The memory is
+// not initialised and is aligned to a cache line.
+class FrameArena
+{
+public:
+	bool hugePages = true;
+
+	FrameArena() {}
+
+	~FrameArena()
+	{
+		releaseOverflow();
+		releaseBlock();
+	}
+
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	void reset()
+	{
+		high_water = std::max(high_water, offset.load(std::memory_order_relaxed));
+		releaseOverflow();
+		if (high_water > capacity)
+		{
+			releaseBlock();
+			allocateBlock(high_water + high_water / 4);
+		}
+		offset.store(0, std::memory_order_relaxed);
+	}
+
+	template <typename T>
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(allocateBytes(count * sizeof(T)));
+	}
+
+	void* allocateBytes(size_t bytes)
+	{
+		bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+		const size_t start = offset.fetch_add(bytes, std::memory_order_relaxed);
+		if (start + bytes <= capacity)
+			return block + start;
+
+		std::lock_guard<std::mutex> lock(overflow_mutex);
+		void* memory = ::operator new(std::max<size_t>(bytes, ALIGNMENT), std::align_val_t(ALIGNMENT));
+		overflow.push_back(memory);
+		return memory;
+	}
+
+	// Most bytes handed out between two resets so far
+	size_t highWaterMark() const
+	{
+		return std::max(high_water, offset.load(std::memory_order_relaxed));
+	}
+
+private:
+	static constexpr size_t ALIGNMENT = 64;
+	static constexpr size_t HUGE_PAGE = size_t(2) << 20;
+
+	char* block = nullptr;
+	size_t capacity = 0, high_water = 0;
+	std::atomic<size_t> offset{ 0 };
+	std::mutex overflow_mutex;
+	std::vector<void*> overflow;
+	// Start and length of the mapping, which is larger than block to align it
+	void* mapping = nullptr;
+	size_t mapping_size = 0;
+
+	void allocateBlock(size_t size)
+	{
+		size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+#if defined(__linux__)
+		mapping_size = size + HUGE_PAGE;
+		mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED)
+		{
+			mapping = nullptr;
+			return;
+		}
+		block = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(mapping) + HUGE_PAGE - 1) & ~uintptr_t(HUGE_PAGE - 1));
+#ifdef MADV_HUGEPAGE
+		if (hugePages)
+			madvise(block, size, MADV_HUGEPAGE);
+#endif
+#else
+		block = static_cast<char*>(::operator new(size, std::align_val_t(HUGE_PAGE)));
+#endif
+		capacity = size;
+	}
+
+	void releaseBlock()
+	{
+		if (!block)
+			return;
+#if defined(__linux__)
+		munmap(mapping, mapping_size);
+		mapping = nullptr;
+#else
+		::operator delete(block, std::align_val_t(HUGE_PAGE));
+#endif
+		block = nullptr;
+		capacity = 0;
+	}
+
+	void releaseOverflow()
+	{
+		for (void* memory : overflow)
+			::operator delete(memory, std::align_val_t(ALIGNMENT));
+		overflow.clear();
+	}
+};
+
+// For buffers that have to outlive a phase: resizes v, leaving headroom
+// when it has to grow so that a size that creeps up from step to step
+// does not reallocate every time.
+template <typename T>
+void resizeWithSlack(std::vector<T>& v, size_t size)
+{
+	if (size > v.capacity())
+		v.reserve(size + size / 4);
+	v.resize(size);
+}
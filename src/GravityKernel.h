@@ -0,0 +1,291 @@
+#pragma once
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GRAVITY_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define GRAVITY_KERNEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Monopole interaction kernels: adds m / d^3 * (s - p) for every source s
+// to (ax, ay). The vector versions use a reciprocal square root estimate
+// refined by one Newton step, which is accurate to float precision. The
+// caller never passes sources closer than BarnesHut::eps.
+//
+// The quadrupole kernels also take the second moments Q of each source
+// about its centre of mass and add the next term of the expansion,
+//   -3 / d^5 * (Q d + tr(Q) / 2 * d) + 15 / 2 * (d.Q.d) / d^7 * d,   d = s - p
+//
+// The widest kernel the CPU supports is picked once at startup.
+namespace GravityKernel
+{
+	typedef void (*AccumulateFn)(const float* sx, const float* sy, const float* sm, int n,
+		float x, float y, float& ax, float& ay);
+	typedef void (*AccumulateQuadrupoleFn)(const float* sx, const float* sy, const float* sm,
+		const float* sxx, const float* sxy, const float* syy, int n, float x, float y, float& ax, float& ay);
+
+	inline void accumulateScalar(const float* sx, const float* sy, const float* sm, int n,
+		float x, float y, float& ax, float& ay)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			float dx = sx[i] - x, dy = sy[i] - y;
+			float r = 1.0f / std::sqrt(dx * dx + dy * dy);
+			float s = sm[i] * r * r * r;
+			ax += s * dx;
+			ay += s * dy;
+		}
+	}
+
+	inline void accumulateQuadrupoleScalar(const float* sx, const float* sy, const float* sm,
+		const float* sxx, const float* sxy, const float* syy, int n, float x, float y, float& ax, float& ay)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			float dx = sx[i] - x, dy = sy[i] - y;
+			float r = 1.0f / std::sqrt(dx * dx + dy * dy);
+			float r2 = r * r, r3 = r2 * r, r5 = r3 * r2;
+			float qx = sxx[i] * dx + sxy[i] * dy, qy = sxy[i] * dx + syy[i] * dy;
+			float s = sm[i] * r3 + r5 * (7.5f * (dx * qx + dy * qy) * r2 - 1.5f * (sxx[i] + syy[i]));
+			ax += s * dx - 3.0f * r5 * qx;
+			ay += s * dy - 3.0f * r5 * qy;
+		}
+	}
+
+#ifdef GRAVITY_KERNEL_X86
+	__attribute__((target("avx2,fma")))
+	inline void accumulateAvx2(const float* sx, const float* sy, const float* sm, int n,
+		float x, float y, float& ax, float& ay)
+	{
+		const __m256 px = _mm256_set1_ps(x), py = _mm256_set1_ps(y);
+		const __m256 half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+		__m256 accx = _mm256_setzero_ps(), accy = _mm256_setzero_ps();
+		int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(sx + i), px);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(sy + i), py);
+			__m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+			__m256 r = _mm256_rsqrt_ps(d2);
+			r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_mul_ps(half, d2), r), r, three_halves));
+			__m256 s = _mm256_mul_ps(_mm256_loadu_ps(sm + i), _mm256_mul_ps(_mm256_mul_ps(r, r), r));
+			accx = _mm256_fmadd_ps(s, dx, accx);
+			accy = _mm256_fmadd_ps(s, dy, accy);
+		}
+		alignas(32) float lanes_x[8], lanes_y[8];
+		_mm256_store_ps(lanes_x, accx);
+		_mm256_store_ps(lanes_y, accy);
+		for (int j = 0; j < 8; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateScalar(sx + i, sy + i, sm + i, n - i, x, y, ax, ay);
+	}
+
+	__attribute__((target("avx512f")))
+	inline void accumulateAvx512(const float* sx, const float* sy, const float* sm, int n,
+		float x, float y, float& ax, float& ay)
+	{
+		const __m512 px = _mm512_set1_ps(x), py = _mm512_set1_ps(y);
+		const __m512 half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+		__m512 accx = _mm512_setzero_ps(), accy = _mm512_setzero_ps();
+		int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(sx + i), px);
+			__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(sy + i), py);
+			__m512 d2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+			__m512 r = _mm512_maskz_rsqrt14_ps(0xFFFF, d2);
+			r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_mul_ps(half, d2), r), r, three_halves));
+			__m512 s = _mm512_mul_ps(_mm512_loadu_ps(sm + i), _mm512_mul_ps(_mm512_mul_ps(r, r), r));
+			accx = _mm512_fmadd_ps(s, dx, accx);
+			accy = _mm512_fmadd_ps(s, dy, accy);
+		}
+		alignas(64) float lanes_x[16], lanes_y[16];
+		_mm512_store_ps(lanes_x, accx);
+		_mm512_store_ps(lanes_y, accy);
+		for (int j = 0; j < 16; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateScalar(sx + i, sy + i, sm + i, n - i, x, y, ax, ay);
+	}
+
+	__attribute__((target("avx2,fma")))
+	inline void accumulateQuadrupoleAvx2(const float* sx, const float* sy, const float* sm,
+		const float* sxx, const float* sxy, const float* syy, int n, float x, float y, float& ax, float& ay)
+	{
+		const __m256 px = _mm256_set1_ps(x), py = _mm256_set1_ps(y);
+		const __m256 half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+		const __m256 three = _mm256_set1_ps(3.0f), fifteen_halves = _mm256_set1_ps(7.5f);
+		__m256 accx = _mm256_setzero_ps(), accy = _mm256_setzero_ps();
+		int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(sx + i), px);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(sy + i), py);
+			__m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+			__m256 r = _mm256_rsqrt_ps(d2);
+			r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_mul_ps(half, d2), r), r, three_halves));
+			__m256 r2 = _mm256_mul_ps(r, r), r3 = _mm256_mul_ps(r2, r), r5 = _mm256_mul_ps(r3, r2);
+			__m256 qxx = _mm256_loadu_ps(sxx + i), qxy = _mm256_loadu_ps(sxy + i), qyy = _mm256_loadu_ps(syy + i);
+			__m256 qx = _mm256_fmadd_ps(qxx, dx, _mm256_mul_ps(qxy, dy));
+			__m256 qy = _mm256_fmadd_ps(qxy, dx, _mm256_mul_ps(qyy, dy));
+			__m256 dqd = _mm256_fmadd_ps(dx, qx, _mm256_mul_ps(dy, qy));
+			__m256 t = _mm256_fnmadd_ps(three_halves, _mm256_add_ps(qxx, qyy), _mm256_mul_ps(_mm256_mul_ps(fifteen_halves, dqd), r2));
+			__m256 s = _mm256_fmadd_ps(_mm256_loadu_ps(sm + i), r3, _mm256_mul_ps(r5, t));
+			__m256 r5x3 = _mm256_mul_ps(three, r5);
+			accx = _mm256_add_ps(accx, _mm256_fnmadd_ps(r5x3, qx, _mm256_mul_ps(s, dx)));
+			accy = _mm256_add_ps(accy, _mm256_fnmadd_ps(r5x3, qy, _mm256_mul_ps(s, dy)));
+		}
+		alignas(32) float lanes_x[8], lanes_y[8];
+		_mm256_store_ps(lanes_x, accx);
+		_mm256_store_ps(lanes_y, accy);
+		for (int j = 0; j < 8; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateQuadrupoleScalar(sx + i, sy + i, sm + i, sxx + i, sxy + i, syy + i, n - i, x, y, ax, ay);
+	}
+
+	__attribute__((target("avx512f")))
+	inline void accumulateQuadrupoleAvx512(const float* sx, const float* sy, const float* sm,
+		const float* sxx, const float* sxy, const float* syy, int n, float x, float y, float& ax, float& ay)
+	{
+		const __m512 px = _mm512_set1_ps(x), py = _mm512_set1_ps(y);
+		const __m512 half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+		const __m512 three = _mm512_set1_ps(3.0f), fifteen_halves = _mm512_set1_ps(7.5f);
+		__m512 accx = _mm512_setzero_ps(), accy = _mm512_setzero_ps();
+		int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(sx + i), px);
+			__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(sy + i), py);
+			__m512 d2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+			__m512 r = _mm512_maskz_rsqrt14_ps(0xFFFF, d2);
+			r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_mul_ps(half, d2), r), r, three_halves));
+			__m512 r2 = _mm512_mul_ps(r, r), r3 = _mm512_mul_ps(r2, r), r5 = _mm512_mul_ps(r3, r2);
+			__m512 qxx = _mm512_loadu_ps(sxx + i), qxy = _mm512_loadu_ps(sxy + i), qyy = _mm512_loadu_ps(syy + i);
+			__m512 qx = _mm512_fmadd_ps(qxx, dx, _mm512_mul_ps(qxy, dy));
+			__m512 qy = _mm512_fmadd_ps(qxy, dx, _mm512_mul_ps(qyy, dy));
+			__m512 dqd = _mm512_fmadd_ps(dx, qx, _mm512_mul_ps(dy, qy));
+			__m512 t = _mm512_fnmadd_ps(three_halves, _mm512_add_ps(qxx, qyy), _mm512_mul_ps(_mm512_mul_ps(fifteen_halves, dqd), r2));
+			__m512 s = _mm512_fmadd_ps(_mm512_loadu_ps(sm + i), r3, _mm512_mul_ps(r5, t));
+			__m512 r5x3 = _mm512_mul_ps(three, r5);
+			accx = _mm512_add_ps(accx, _mm512_fnmadd_ps(r5x3, qx, _mm512_mul_ps(s, dx)));
+			accy = _mm512_add_ps(accy, _mm512_fnmadd_ps(r5x3, qy, _mm512_mul_ps(s, dy)));
+		}
+		alignas(64) float lanes_x[16], lanes_y[16];
+		_mm512_store_ps(lanes_x, accx);
+		_mm512_store_ps(lanes_y, accy);
+		for (int j = 0; j < 16; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateQuadrupoleScalar(sx + i, sy + i, sm + i, sxx + i, sxy + i, syy + i, n - i, x, y, ax, ay);
+	}
+#endif
+
+#ifdef GRAVITY_KERNEL_NEON
+	inline void accumulateNeon(const float* sx, const float* sy, const float* sm, int n,
+		float x, float y, float& ax, float& ay)
+	{
+		const float32x4_t px = vdupq_n_f32(x), py = vdupq_n_f32(y);
+		float32x4_t accx = vdupq_n_f32(0), accy = vdupq_n_f32(0);
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			float32x4_t dx = vsubq_f32(vld1q_f32(sx + i), px);
+			float32x4_t dy = vsubq_f32(vld1q_f32(sy + i), py);
+			float32x4_t d2 = vmlaq_f32(vmulq_f32(dy, dy), dx, dx);
+			float32x4_t r = vrsqrteq_f32(d2);
+			r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(d2, r), r));
+			r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(d2, r), r));
+			float32x4_t s = vmulq_f32(vld1q_f32(sm + i), vmulq_f32(vmulq_f32(r, r), r));
+			accx = vmlaq_f32(accx, s, dx);
+			accy = vmlaq_f32(accy, s, dy);
+		}
+		float lanes_x[4], lanes_y[4];
+		vst1q_f32(lanes_x, accx);
+		vst1q_f32(lanes_y, accy);
+		for (int j = 0; j < 4; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateScalar(sx + i, sy + i, sm + i, n - i, x, y, ax, ay);
+	}
+
+	inline void accumulateQuadrupoleNeon(const float* sx, const float* sy, const float* sm,
+		const float* sxx, const float* sxy, const float* syy, int n, float x, float y, float& ax, float& ay)
+	{
+		const float32x4_t px = vdupq_n_f32(x), py = vdupq_n_f32(y);
+		float32x4_t accx = vdupq_n_f32(0), accy = vdupq_n_f32(0);
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			float32x4_t dx = vsubq_f32(vld1q_f32(sx + i), px);
+			float32x4_t dy = vsubq_f32(vld1q_f32(sy + i), py);
+			float32x4_t d2 = vmlaq_f32(vmulq_f32(dy, dy), dx, dx);
+			float32x4_t r = vrsqrteq_f32(d2);
+			r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(d2, r), r));
+			r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(d2, r), r));
+			float32x4_t r2 = vmulq_f32(r, r), r3 = vmulq_f32(r2, r), r5 = vmulq_f32(r3, r2);
+			float32x4_t qxx = vld1q_f32(sxx + i), qxy = vld1q_f32(sxy + i), qyy = vld1q_f32(syy + i);
+			float32x4_t qx = vmlaq_f32(vmulq_f32(qxy, dy), qxx, dx);
+			float32x4_t qy = vmlaq_f32(vmulq_f32(qyy, dy), qxy, dx);
+			float32x4_t dqd = vmlaq_f32(vmulq_f32(dy, qy), dx, qx);
+			float32x4_t t = vmlsq_n_f32(vmulq_n_f32(vmulq_f32(dqd, r2), 7.5f), vaddq_f32(qxx, qyy), 1.5f);
+			float32x4_t s = vmlaq_f32(vmulq_f32(r5, t), vld1q_f32(sm + i), r3);
+			float32x4_t r5x3 = vmulq_n_f32(r5, 3.0f);
+			accx = vaddq_f32(accx, vmlsq_f32(vmulq_f32(s, dx), r5x3, qx));
+			accy = vaddq_f32(accy, vmlsq_f32(vmulq_f32(s, dy), r5x3, qy));
+		}
+		float lanes_x[4], lanes_y[4];
+		vst1q_f32(lanes_x, accx);
+		vst1q_f32(lanes_y, accy);
+		for (int j = 0; j < 4; j++)
+		{
+			ax += lanes_x[j];
+			ay += lanes_y[j];
+		}
+		accumulateQuadrupoleScalar(sx + i, sy + i, sm + i, sxx + i, sxy + i, syy + i, n - i, x, y, ax, ay);
+	}
+#endif
+
+	struct Kernel
+	{
+		AccumulateFn accumulate;
+		AccumulateQuadrupoleFn accumulateQuadrupole;
+		const char* name;
+	};
+
+	inline Kernel detect()
+	{
+#ifdef GRAVITY_KERNEL_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return { accumulateAvx512, accumulateQuadrupoleAvx512, "avx512" };
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return { accumulateAvx2, accumulateQuadrupoleAvx2, "avx2" };
+#endif
+#ifdef GRAVITY_KERNEL_NEON
+		return { accumulateNeon, accumulateQuadrupoleNeon, "neon" };
+#endif
+		return { accumulateScalar, accumulateQuadrupoleScalar, "scalar" };
+	}
+
+	inline const Kernel& get()
+	{
+		static const Kernel kernel = detect();
+		return kernel;
+	}
+}
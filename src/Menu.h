@@ -73,8 +73,7 @@ public:
 			int newLeafSize = minSize + (SLIDER_maxleafsize->point * (maxSize - minSize));
 			if (newLeafSize != this->sim.bh.maxLeafSize)
 			{
-				this->sim.bh.maxLeafSize = newLeafSize;
-				this->sim.bh.head.maxLeafSize = newLeafSize;
+				this->sim.bh.setMaxLeafSize(newLeafSize);
 				SLIDER_maxleafsize->shape->label.setString("Max. Leaf Size: " + std::to_string(newLeafSize));
 			}
 			});
@@ -44,7 +44,6 @@ public:
 			float delta = event.mouseWheelScroll.delta;
 			int sign = delta < 0 ? -1 : 1;
 			Screen::zoomIn(sign * scrollSpeed, sf::Vector2i(event.mouseWheelScroll.x, event.mouseWheelScroll.y));
-			update_bodies();
 		}
 		else if (event.type == sf::Event::MouseButtonPressed)
 		{
@@ -60,7 +59,6 @@ public:
 			}
 			else if (event.mouseButton.button == sf::Mouse::Middle)
 			{
-				std::vector<Body>& bodies = sim.bodies;
 				sf::Vector2f center = Screen::window.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
 				if (Constants::mode == "CIRCLE")
 				{
@@ -92,14 +90,6 @@ public:
 		}
 	}
 
-	void update_bodies()
-	{
-		for (Body& body : sim.bodies)
-		{
-			body.update_drawables();
-		}
-	}
-
 	void frameUpdate()
 	{
 		update_radius();
@@ -1,30 +1,37 @@
 #pragma once
 #include "Body.h"
-#include <SFML/Graphics.hpp>
+#include "FrameArena.h"
+#include "ThreadPool.h"
+#include <SFML/System/Vector2.hpp>
 #include <array>
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <climits>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 
 
 class alignas(64) Node
 {
 public:
 	sf::Vector2f top_left, bottom_right;
-	int next, depth;
+	int next;
 	float maxRadius = 0;
 	int children = 0;
-	int splits[3] = {0, 0, 0};
 
 	sf::Vector2f center_mass{ 0, 0 };
 
 	float mass = 0;
 	int start, end;
 
-	Node(sf::Vector2f top_left, sf::Vector2f bottom_right, int next, int start, int end, int depth) 
-		: top_left(top_left), bottom_right(bottom_right), next(next), start(start), end(end), depth(depth)
+	Node() {}
+
+	Node(sf::Vector2f top_left, sf::Vector2f bottom_right, int next, int start, int end) 
+		: top_left(top_left), bottom_right(bottom_right), next(next), start(start), end(end)
 	{
 		sf::Vector2f center = sf::Vector2f(top_left.x + (bottom_right.x - top_left.x) / 2, top_left.y + (bottom_right.y - top_left.y) / 2);
 	}
@@ -44,86 +51,440 @@ public:
 		return end - start;
 	}
 
-	float distanceFromBody(const Body& body) const
+	float distanceFromPoint(float x, float y) const
 	{
-		float Xn = std::max(top_left.x, std::min(body.center.x, bottom_right.x));
-		float Yn = std::max(top_left.y, std::min(body.center.y, bottom_right.y));
-		float Dx = Xn - body.center.x;
-		float Dy = Yn - body.center.y;
+		float Xn = std::max(top_left.x, std::min(x, bottom_right.x));
+		float Yn = std::max(top_left.y, std::min(y, bottom_right.y));
+		float Dx = Xn - x;
+		float Dy = Yn - y;
 		return sqrt(Dx * Dx + Dy * Dy);
 	}
 };
 
+// What the gravity walks read of a node, packed into 24 bytes so that a
+// cache line holds more than two of them. children is 0 for a leaf.
+struct WalkNode
+{
+	float cx, cy, mass, size;
+	int children, next;
+};
+
+// Second moments of a node's mass about its centre of mass,
+// sum m * (p - c)(p - c)^T. Read by the walks only for nodes that pass
+// the opening test.
+struct WalkMoments
+{
+	float qxx, qxy, qyy;
+};
+
+struct SlotRange
+{
+	int start, end;
+};
+
 class alignas(64) QuadTree
 {
 public:
 	std::vector<Node> nodes;
 	int maxLeafSize;
-	std::vector<Body>& bodies;
-
-	QuadTree(std::vector<Body>& bodies, int maxLeafSize) 
+	Bodies& bodies;
+	// Build by sorting Morton keys instead of partitioning node by node
+	bool mortonBuild = true;
+	// The tree is built over a permutation of the bodies: node ranges
+	// [start, end) index order, and order[slot] is the body in that slot.
+	// Every reorderInterval builds the bodies themselves are moved into
+	// tree order and order becomes the identity, in between body indices
+	// stay stable.
+	std::vector<int> order;
+	int reorderInterval = 1;
+	// The tree covers the bodies [bodyBegin, bodyEnd), a negative bodyEnd
+	// meaning all bodies from bodyBegin on. order holds absolute indices.
+	int bodyBegin = 0, bodyEnd = -1;
+	// Copies of the node fields the gravity walks use, refreshed by
+	// calculateCenterMass. nodes keeps everything else. Node i is at
+	// walkIndex[i], which numbers the nodes depth first (pre-order) when
+	// depthFirstWalk is set and is the identity otherwise. Breadth first
+	// keeps siblings next to each other, which the walks mostly step
+	// through, and measures as fast or faster, so it stays the default.
+	std::vector<WalkNode> walkNodes;
+	std::vector<WalkMoments> walkMoments;
+	std::vector<SlotRange> walkRanges;
+	std::vector<int> walkIndex;
+	bool depthFirstWalk = false;
+	// Memory for the buffers that only live during buildNodes, reset at its start
+	FrameArena scratch;
+	// Steps the previous topology may be refitted to the moved bodies
+	// before the tree is rebuilt, 0 rebuilds every step. The tree is also
+	// rebuilt early once more than refitEscapeLimit of the bodies are
+	// further than refitTolerance times their leaf size outside the leaf.
+	int refitSteps = 0;
+	float refitTolerance = 0.25f;
+	float refitEscapeLimit = 0.01f;
+
+	// Levels encoded in a 64-bit Morton key. Nodes are not split below
+	// depth_limit either, deeper nodes become oversized leaves.
+	static constexpr int MORTON_LEVELS = 32;
+
+	QuadTree(Bodies& bodies, int maxLeafSize) 
 		: bodies(bodies), maxLeafSize(maxLeafSize)
 	{
 	}
 
+	// std::partition over the slots [first, last) of order, pred takes a body index
+	template <typename Predicate>
+	int partitionBodies(int first, int last, Predicate pred)
+	{
+		while (first < last)
+		{
+			if (pred(order[first]))
+			{
+				first++;
+				continue;
+			}
+			last--;
+			while (first < last && !pred(order[last]))
+				last--;
+			if (first == last)
+				break;
+			std::swap(order[first], order[last]);
+			first++;
+		}
+		return first;
+	}
+
+	// Bodies are assigned to quadrants by their position on the root grid
+	// (see quantize), so this and createChildrenFromKeys split identically.
+	// Leaves the node a leaf when its bodies cannot be told apart above
+	// depth_limit.
 	void createChildren(size_t index)
 	{
-		if (nodes[index].depth > 200)
-			return;
 		const int start = nodes[index].start, end = nodes[index].end;
-		const sf::Vector2f length = (nodes[index].bottom_right - nodes[index].top_left) / 2.0f;
-		const sf::Vector2f center = nodes[index].top_left + length;
+		const sf::Vector2f origin = grid_origin;
+
+		const std::vector<float>& xs = bodies.x;
+		const std::vector<float>& ys = bodies.y;
+
+		const uint32_t x0 = quantize(xs[order[start]], origin.x), y0 = quantize(ys[order[start]], origin.y);
+		uint32_t x_diff = 0, y_diff = 0;
+		for (int slot = start + 1; slot < end; slot++)
+		{
+			x_diff |= quantize(xs[order[slot]], origin.x) ^ x0;
+			y_diff |= quantize(ys[order[slot]], origin.y) ^ y0;
+		}
+		const int level = commonLevel((spreadBits(y_diff) << 1) | spreadBits(x_diff));
+		if (level >= depth_limit)
+			return;
+		shrinkToLevel(index, level, (spreadBits(y0) << 1) | spreadBits(x0));
 
+		const int shift = MORTON_LEVELS - 1 - level;
 		int splits[] = { start, 0, 0, 0, end };
 
-		splits[2] = std::partition(bodies.begin() + start, bodies.begin() + end, [&center](const Body& b) {
-			return b.center.y < center.y;
-			}) - bodies.begin();
+		splits[2] = partitionBodies(start, end, [this, &ys, &origin, shift](int b) {
+			return ((quantize(ys[b], origin.y) >> shift) & 1) == 0;
+			});
 
-		splits[1] = std::partition(bodies.begin() + start, bodies.begin() + splits[2], [&center](const Body& b) {
-			return b.center.x < center.x;
-			}) - bodies.begin();
+		splits[1] = partitionBodies(start, splits[2], [this, &xs, &origin, shift](int b) {
+			return ((quantize(xs[b], origin.x) >> shift) & 1) == 0;
+			});
 
-		splits[3] = std::partition(bodies.begin() + splits[2], bodies.begin() + end, [&center](const Body& b) {
-			return b.center.x < center.x;
-			}) - bodies.begin();
+		splits[3] = partitionBodies(splits[2], end, [this, &xs, &origin, shift](int b) {
+			return ((quantize(xs[b], origin.x) >> shift) & 1) == 0;
+			});
 
-		nodes[index].splits[0] = splits[1];
-		nodes[index].splits[1] = splits[2];
-		nodes[index].splits[2] = splits[3];
+		emplaceChildren(index, splits);
+	}
+
+	// Level of the smallest grid cell holding two keys, given their xor
+	// (or the or of several xors against one key)
+	static int commonLevel(uint64_t diff)
+	{
+		int level = 0;
+		while (level < MORTON_LEVELS && ((diff >> (2 * (MORTON_LEVELS - 1 - level))) & 3) == 0)
+			level++;
+		return level;
+	}
 
-		nodes[index].children = nodes.size();
+	// Collapses the chain of single-child nodes above a split: nodes[index]
+	// becomes the cell at level containing key, a descendant of its own
+	// cell. Only empty space is cut off, so boxes stay disjoint.
+	void shrinkToLevel(size_t index, int level, uint64_t key)
+	{
+		Node& node = nodes[index];
+		for (int d = node_depth[index]; d < level; d++)
+		{
+			const int quadrant = int((key >> (2 * (MORTON_LEVELS - 1 - d))) & 3);
+			childBounds(node.top_left, node.bottom_right, quadrant >> 1, quadrant & 1);
+		}
+		node_depth[index] = level;
+	}
+
+	// Quadrant i (0 = top, 1 = bottom), j (0 = left, 1 = right) of a box
+	static void childBounds(sf::Vector2f& top_left, sf::Vector2f& bottom_right, int i, int j)
+	{
+		const sf::Vector2f length = (bottom_right - top_left) / 2.0f;
+		const sf::Vector2f child_top_left(top_left.x + j * length.x, top_left.y + i * length.y);
+		bottom_right = sf::Vector2f(bottom_right.x - (1 - j) * length.x, bottom_right.y - (1 - i) * length.y);
+		top_left = child_top_left;
+	}
+
+	// Appends the four children of nodes[index], child k holding bodies [splits[k], splits[k + 1])
+	void emplaceChildren(size_t index, const int splits[5])
+	{
+		const int first_child = nodes.size();
+		nodes.resize(first_child + 4);
+		node_depth.resize(first_child + 4);
+		setChildren(index, first_child, splits);
+	}
+
+	// Fills the four already allocated nodes from first_child on as the children of nodes[index]
+	void setChildren(size_t index, int first_child, const int splits[5])
+	{
+		Node& parent = nodes[index];
+		parent.children = first_child;
 
 		for (int i = 0; i < 2; i++)
 		{
 			for (int j = 0; j < 2; j++)
 			{
-				nodes.emplace_back(sf::Vector2f(nodes[index].top_left.x + j * length.x, nodes[index].top_left.y + i * length.y),
-					sf::Vector2f(nodes[index].bottom_right.x - (1 - j) * length.x, nodes[index].bottom_right.y - (1 - i) * length.y),
-					(((i == 1) && (j == 1)) ? nodes[index].next : nodes.size() + 1),
-					splits[2 * i + j], splits[2 * i + j + 1], nodes[index].depth + 1);
+				const int child = first_child + 2 * i + j;
+				sf::Vector2f top_left = parent.top_left, bottom_right = parent.bottom_right;
+				childBounds(top_left, bottom_right, i, j);
+				nodes[child] = Node(top_left, bottom_right, (((i == 1) && (j == 1)) ? parent.next : child + 1),
+					splits[2 * i + j], splits[2 * i + j + 1]);
+				node_depth[child] = node_depth[index] + 1;
 			}
 		}
 	}
 
-	void build()
+	// refit false always rebuilds, for users that need every body inside
+	// its node's box
+	void build(ThreadPool& pool, bool refit = true)
 	{
-		nodes.clear();
-		nodes.reserve(bodies.size() / 4);
+		buildOrRefitNodes(pool, refit);
+		calculateCenterMass(pool);
+	}
 
-		sf::Vector2f top_left(INT_MAX, INT_MAX), bottom_right(INT_MIN, INT_MIN);
-		for (const Body& body : bodies)
+	// build without the upward pass
+	void buildOrRefitNodes(ThreadPool& pool, bool refit = true)
+	{
+		if (!refit || refitSteps <= 0 || !refitNodes(pool))
+			buildNodes(pool);
+	}
+
+	// Subdivides the bodies and fills the leaf sums, without the upward pass.
+	void buildNodes(ThreadPool& pool)
+	{
+		scratch.reset();
+		if (mortonBuild)
+			buildNodesMorton(pool);
+		else
+			buildNodesPartition(pool);
+
+		if (++builds_since_reorder >= reorderInterval)
+			reorderBodies(pool);
+		built_version = bodies.layoutVersion;
+		built_leaf_size = maxLeafSize;
+		refits_since_build = 0;
+	}
+
+	int lastBody() const
+	{
+		return bodyEnd < 0 ? int(bodies.size()) : bodyEnd;
+	}
+
+	int bodyCount() const
+	{
+		return lastBody() - bodyBegin;
+	}
+
+	// Moves the bodies into tree order, after which order is the identity
+	void reorderBodies(ThreadPool& pool)
+	{
+		bodies.permute(order, pool, scratch, bodyBegin);
+		pool.parallelFor(0, order.size(), [this](int start, int end) {
+			for (int slot = start; slot < end; slot++)
+				order[slot] = bodyBegin + slot;
+		});
+		builds_since_reorder = 0;
+	}
+
+	// Keeps the nodes, boxes and body ranges of the last build and only
+	// recomputes the leaf sums from the current positions, without the
+	// upward pass. Returns false, leaving the nodes to be rebuilt, when
+	// bodies were added or removed, maxLeafSize changed, refitSteps is used
+	// up, or too many bodies drifted out of their leaf.
+	//
+	// Boxes stay the disjoint cells of the build, which the collision edge
+	// test relies on. A body outside its leaf box instead adds the distance
+	// to the box to the leaf's maxRadius, so pruning by box distance and
+	// maxRadius still reaches it.
+	bool refitNodes(ThreadPool& pool)
+	{
+		if (nodes.empty() || built_version != bodies.layoutVersion || order.size() != bodyCount()
+			|| order_begin != bodyBegin || built_leaf_size != maxLeafSize || refits_since_build >= refitSteps)
+			return false;
+		// Bodies too fast for even one refit, try again after a growing number of rebuilds
+		if (refit_skip > 0)
 		{
-			if (!body.enabled)
+			refit_skip--;
+			return false;
+		}
+
+		std::atomic<int> escaped(0);
+		pool.parallelFor(0, nodes.size(), [this, &escaped](int start, int end) {
+			int count = 0;
+			for (int i = start; i < end; i++)
+			{
+				Node& node = nodes[i];
+				node.mass = 0;
+				node.center_mass = sf::Vector2f(0, 0);
+				node.maxRadius = 0;
+				if (!node.isLeaf())
+					continue;
+				sumLeaf(i);
+				count += fitLeafRadius(i);
+			}
+			escaped += count;
+		});
+		if (escaped > refitEscapeLimit * bodyCount())
+		{
+			if (refits_since_build == 0)
+				refit_skip = refit_backoff = std::min(2 * refit_backoff + 1, refitSteps);
+			return false;
+		}
+		refit_backoff = 0;
+		refits_since_build++;
+		return true;
+	}
+
+	// Grows maxRadius of a refitted leaf by how far its bodies lie outside
+	// the box. Returns the number of them beyond refitTolerance.
+	int fitLeafRadius(size_t index)
+	{
+		Node& node = nodes[index];
+		const float tolerance = refitTolerance * (node.bottom_right.x - node.top_left.x);
+		int escaped = 0;
+		for (int j = node.start; j < node.end; j++)
+		{
+			const int b = order[j];
+			if (!bodies.isEnabled(b))
 				continue;
-			if (body.center.x < top_left.x)
-				top_left.x = body.center.x;
-			if (body.center.y < top_left.y)
-				top_left.y = body.center.y;
-			if (body.center.x > bottom_right.x)
-				bottom_right.x = body.center.x;
-			if (body.center.y > bottom_right.y)
-				bottom_right.y = body.center.y;
+			const float outside = node.distanceFromPoint(bodies.x[b], bodies.y[b]);
+			escaped += outside > tolerance;
+			node.maxRadius = std::max(node.maxRadius, bodies.radius[b] + outside);
+		}
+		return escaped;
+	}
+
+	void buildNodesPartition(ThreadPool& pool)
+	{
+		nodes.clear();
+		nodes.reserve(bodyCount() / 4);
+		addRoot(pool);
+		resetOrder();
+
+		level_begin.assign(1, 0);
+		for (int begin = 0, end = 1; begin < end; begin = end, end = nodes.size())
+		{
+			level_begin.push_back(end);
+			for (int i = begin; i < end; i++)
+			{
+				if (nodes[i].getLeafSize() > maxLeafSize)
+					createChildren(i);
+			}
+		}
+
+		pool.parallelFor(0, nodes.size(), [this](int start, int end) {
+			for (int i = start; i < end; i++)
+			{
+				if (nodes[i].isLeaf())
+					sumLeaf(i);
+			}
+		});
+	}
+
+	// Same nodes as buildNodesPartition: the key of a body interleaves its
+	// grid coordinates, so its top two bits are the root quadrant, the next
+	// two the quadrant below that, and so on. order is radix sorted by key
+	// once, after which the children of a node are found by binary
+	// search for their two key bits instead of by partitioning.
+	//
+	// Every step runs on the pool, and none depends on the thread count:
+	// keys are computed per body, the sort is stable, and nodes are created
+	// one level at a time. A level's children are numbered by a prefix sum
+	// over its splitting nodes, which is the order the serial breadth-first
+	// loop would append them in.
+	void buildNodesMorton(ThreadPool& pool)
+	{
+		nodes.clear();
+		nodes.reserve(bodyCount() / 4);
+		addRoot(pool);
+
+		resetOrder();
+		computeMortonKeys(pool);
+		radixSortKeys(pool);
+
+		level_begin.assign(1, 0);
+		for (int begin = 0, end = 1; begin < end; begin = end, end = nodes.size())
+		{
+			level_begin.push_back(end);
+			int* first_child = scratch.allocate<int>(end - begin);
+			int next_child = end;
+			for (int i = begin; i < end; i++)
+			{
+				const bool split = nodes[i].getLeafSize() > maxLeafSize && keyLevel(i) < depth_limit;
+				first_child[i - begin] = split ? next_child : 0;
+				next_child += split ? 4 : 0;
+			}
+			resizeWithSlack(nodes, next_child);
+			resizeWithSlack(node_depth, next_child);
+
+			pool.parallelFor(begin, end, [this, begin, first_child](int start, int end) {
+				for (int i = start; i < end; i++)
+				{
+					if (first_child[i - begin])
+						createChildrenFromKeys(i, first_child[i - begin]);
+					else
+						sumLeaf(i);
+				}
+			});
+		}
+	}
+
+	// Root box: the square around every enabled body. Each thread scans one
+	// range, min and max are exact so merging the ranges matches one scan.
+	void addRoot(ThreadPool& pool)
+	{
+		const int threads = pool.size(), first = bodyBegin, n = bodyCount();
+		sf::Vector2f* mins = scratch.allocate<sf::Vector2f>(threads);
+		sf::Vector2f* maxs = scratch.allocate<sf::Vector2f>(threads);
+		std::fill(mins, mins + threads, sf::Vector2f(INT_MAX, INT_MAX));
+		std::fill(maxs, maxs + threads, sf::Vector2f(INT_MIN, INT_MIN));
+		pool.run([this, threads, first, n, mins, maxs](int thread) {
+			sf::Vector2f& top_left = mins[thread];
+			sf::Vector2f& bottom_right = maxs[thread];
+			for (int i = first + int(1LL * n * thread / threads); i < first + int(1LL * n * (thread + 1) / threads); i++)
+			{
+				if (!bodies.isEnabled(i))
+					continue;
+				if (bodies.x[i] < top_left.x)
+					top_left.x = bodies.x[i];
+				if (bodies.y[i] < top_left.y)
+					top_left.y = bodies.y[i];
+				if (bodies.x[i] > bottom_right.x)
+					bottom_right.x = bodies.x[i];
+				if (bodies.y[i] > bottom_right.y)
+					bottom_right.y = bodies.y[i];
+			}
+		});
+
+		sf::Vector2f top_left = mins[0], bottom_right = maxs[0];
+		for (int thread = 1; thread < threads; thread++)
+		{
+			top_left.x = std::min(top_left.x, mins[thread].x);
+			top_left.y = std::min(top_left.y, mins[thread].y);
+			bottom_right.x = std::max(bottom_right.x, maxs[thread].x);
+			bottom_right.y = std::max(bottom_right.y, maxs[thread].y);
 		}
 		bottom_right.x += 0.1f;
 		bottom_right.y += 0.1f;
@@ -144,73 +505,386 @@ public:
 			y_length = x_length;
 		}
 
-		nodes.emplace_back(top_left, bottom_right, 0, 0, bodies.size(), 0);
+		nodes.emplace_back(top_left, bottom_right, 0, 0, n);
+		node_depth.assign(1, 0);
+		grid_origin = top_left;
+		grid_scale = 4294967296.0 / (double(bottom_right.x) - top_left.x);
+
+		// Below this many halvings a cell is smaller than the float spacing
+		// of its coordinates and its box no longer splits, bodies closer than
+		// that stay together in one leaf.
+		const float extent = std::max(std::max(std::abs(top_left.x), std::abs(top_left.y)),
+			std::max(std::abs(bottom_right.x), std::abs(bottom_right.y)));
+		depth_limit = std::ilogb(x_length) - std::ilogb(extent) + std::numeric_limits<float>::digits - 1;
+		depth_limit = std::max(0, std::min(depth_limit, MORTON_LEVELS));
+	}
+
+	// Coordinate on the 2^MORTON_LEVELS grid spanning the root box. Bit
+	// (MORTON_LEVELS - 1 - depth) is the half of a node at depth the
+	// coordinate lies in. Disabled bodies outside the box are clamped.
+	uint32_t quantize(float v, float origin) const
+	{
+		const double t = (double(v) - origin) * grid_scale;
+		if (!(t > 0))
+			return 0;
+		return t < 4294967295.0 ? uint32_t(t) : 0xFFFFFFFFu;
+	}
 
-		for (int i = 0; i < nodes.size(); i++)
+	// Moves the bits of v to the even bit positions
+	static uint64_t spreadBits(uint32_t v)
+	{
+		uint64_t x = v;
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x << 2)) & 0x3333333333333333ull;
+		x = (x | (x << 1)) & 0x5555555555555555ull;
+		return x;
+	}
+
+	void sumLeaf(size_t index)
+	{
+		Node& node = nodes[index];
+		sf::Vector2f mass_sum{ 0, 0 };
+		for (int j = node.start; j < node.end; j++)
 		{
-			//std::cout << i << " " << nodes[i].getLeafSize() << std::endl;
-			if (nodes[i].getLeafSize() > maxLeafSize)
+			const int b = order[j];
+			mass_sum.x += bodies.x[b] * bodies.mass[b];
+			mass_sum.y += bodies.y[b] * bodies.mass[b];
+			node.mass += bodies.mass[b];
+			node.maxRadius = std::max(node.maxRadius, bodies.radius[b]);
+		}
+		if (node.mass == 0)
+			return;
+		node.center_mass = mass_sum / node.mass;
+	}
+
+	// Moments of a leaf's bodies, after sumLeaf
+	void sumLeafMoments(size_t index)
+	{
+		const Node& node = nodes[index];
+		WalkMoments& q = moments[index];
+		q = { 0, 0, 0 };
+		if (node.isEmpty())
+			return;
+		for (int j = node.start; j < node.end; j++)
+		{
+			const int b = order[j];
+			float dx = bodies.x[b] - node.center_mass.x, dy = bodies.y[b] - node.center_mass.y;
+			q.qxx += bodies.mass[b] * dx * dx;
+			q.qxy += bodies.mass[b] * dx * dy;
+			q.qyy += bodies.mass[b] * dy * dy;
+		}
+	}
+
+	// Keeps the previous permutation as the starting point, it is nearly
+	// sorted already, unless bodies were added or removed since.
+	void resetOrder()
+	{
+		if (order.size() == bodyCount() && order_begin == bodyBegin)
+			return;
+		order.resize(bodyCount());
+		for (size_t slot = 0; slot < order.size(); slot++)
+			order[slot] = bodyBegin + slot;
+		order_begin = bodyBegin;
+		builds_since_reorder = 0;
+	}
+
+	void computeMortonKeys(ThreadPool& pool)
+	{
+		const sf::Vector2f origin = grid_origin;
+		entries = scratch.allocate<KeyEntry>(order.size());
+		pool.parallelFor(0, order.size(), [this, &origin](int start, int end) {
+			for (int slot = start; slot < end; slot++)
 			{
-				createChildren(i);
+				const int b = order[slot];
+				entries[slot].key = (spreadBits(quantize(bodies.y[b], origin.y)) << 1) | spreadBits(quantize(bodies.x[b], origin.x));
+				entries[slot].index = b;
 			}
-			else
+		});
+	}
+
+	// Radix sort of the entries by the upper 32 bits of their key (the
+	// first 16 levels). One MSD pass on the top byte splits the bodies into
+	// 256 buckets small enough to stay in cache, each of which is then LSD
+	// sorted on the next three bytes. Both are stable and skip bytes that
+	// are equal for every key. Runs that share all 32 bits and are too big
+	// for a leaf need the lower bits, they are sorted separately afterwards.
+	//
+	// In the MSD pass every thread counts and scatters one contiguous range.
+	// Its slots in a bucket follow those of the ranges before it, so the
+	// result is the same as a serial stable pass. Buckets are independent.
+	void radixSortKeys(ThreadPool& pool)
+	{
+		const int n = order.size(), threads = pool.size();
+		sorted_entries = scratch.allocate<KeyEntry>(n);
+
+		size_t* offsets = scratch.allocate<size_t>(size_t(threads) * 256);
+		std::fill(offsets, offsets + size_t(threads) * 256, 0);
+		pool.run([this, n, threads, offsets](int thread) {
+			size_t* counts = &offsets[size_t(thread) * 256];
+			for (int b = int(1LL * n * thread / threads); b < int(1LL * n * (thread + 1) / threads); b++)
+				counts[entries[b].key >> 56]++;
+		});
+		size_t buckets[257];
+		size_t sum = 0;
+		for (int d = 0; d < 256; d++)
+		{
+			buckets[d] = sum;
+			for (int thread = 0; thread < threads; thread++)
 			{
-				sf::Vector2f mass_sum{ 0, 0 };
-				for (int j = nodes[i].start; j < nodes[i].end; j++)
-				{
-					mass_sum += bodies[j].center * bodies[j].mass;
-					nodes[i].mass += bodies[j].mass;
-					nodes[i].maxRadius = std::max(nodes[i].maxRadius, bodies[j].radius);
-				}
-				if (nodes[i].mass != 0)
-					nodes[i].center_mass = mass_sum / nodes[i].mass;
+				size_t count = offsets[size_t(thread) * 256 + d];
+				offsets[size_t(thread) * 256 + d] = sum;
+				sum += count;
 			}
 		}
-		calculateCenterMass();
+		buckets[256] = sum;
+		pool.run([this, n, threads, offsets](int thread) {
+			size_t* slots = &offsets[size_t(thread) * 256];
+			for (int b = int(1LL * n * thread / threads); b < int(1LL * n * (thread + 1) / threads); b++)
+				sorted_entries[slots[entries[b].key >> 56]++] = entries[b];
+		});
+
+		pool.parallelForDynamic(0, 256, 1, [this, &buckets](int begin, int end, int) {
+			for (int bucket = begin; bucket < end; bucket++)
+				sortBucket(buckets[bucket], buckets[bucket + 1]);
+		});
+
+		keys = scratch.allocate<uint64_t>(n);
+		order.resize(n);
+		pool.parallelFor(0, n, [this](int start, int end) {
+			for (int slot = start; slot < end; slot++)
+			{
+				keys[slot] = entries[slot].key;
+				order[slot] = entries[slot].index;
+			}
+		});
 	}
 
-	void calculateCenterMass()
+	// Sorts sorted_entries[first, last), which share their top byte, into entries[first, last)
+	void sortBucket(size_t first, size_t last)
 	{
-		for (int i = nodes.size() - 1; i >= 0; i--)
+		const size_t count = last - first;
+		KeyEntry* src = sorted_entries + first;
+		KeyEntry* dst = entries + first;
+		for (int shift = 32; shift < 56; shift += 8)
 		{
-			if (nodes[i].isLeaf())
-				continue;
-			int c = nodes[i].children;
+			if (radixPass(src, dst, count, shift))
+				std::swap(src, dst);
+		}
+		if (src != entries + first)
+			std::copy(src, src + count, entries + first);
 
-			while (c != nodes[i].next)
+		while (first < last)
+		{
+			size_t run_end = first + 1;
+			while (run_end < last && (entries[run_end].key >> 32) == (entries[first].key >> 32))
+				run_end++;
+			if (run_end - first > maxLeafSize)
 			{
-				nodes[i].center_mass += nodes[c].mass * nodes[c].center_mass;
-				nodes[i].mass += nodes[c].mass;
-				c = nodes[c].next;
-				nodes[i].maxRadius = std::max(nodes[i].maxRadius, nodes[c].maxRadius);
+				std::sort(entries + first, entries + run_end, [](const KeyEntry& a, const KeyEntry& b) {
+					return a.key < b.key || (a.key == b.key && a.index < b.index);
+					});
 			}
+			first = run_end;
+		}
+	}
+
+	// Level at which the bodies of nodes[index] split. A node with more
+	// than maxLeafSize bodies covers whole runs of equal upper 32 key bits,
+	// or lies inside one that radixSortKeys sorted in full, so its first
+	// and last keys are its smallest and largest.
+	int keyLevel(size_t index) const
+	{
+		return commonLevel(keys[nodes[index].start] ^ keys[nodes[index].end - 1]);
+	}
 
-			nodes[i].center_mass /= nodes[i].mass;
+	void createChildrenFromKeys(size_t index, int first_child)
+	{
+		const int start = nodes[index].start, end = nodes[index].end;
+		const int level = keyLevel(index);
+		shrinkToLevel(index, level, keys[start]);
+		const int shift = 2 * (MORTON_LEVELS - 1 - level);
+		int splits[] = { start, 0, 0, 0, end };
+		for (int quadrant = 1; quadrant < 4; quadrant++)
+		{
+			splits[quadrant] = std::partition_point(keys + splits[quadrant - 1], keys + end,
+				[shift, quadrant](uint64_t key) { return int((key >> shift) & 3) < quadrant; }) - keys;
 		}
+		setChildren(index, first_child, splits);
 	}
 
-	void draw(sf::RenderWindow& window, size_t index = 0) const
+	// The nodes of level l of the last build are [levelBegin(l),
+	// levelBegin(l + 1)), for l below levelCount(). Children are always on
+	// the level after their parent.
+	int levelCount() const
 	{
-		const Node& node = nodes[index];
+		return int(level_begin.size()) - 1;
+	}
 
-		sf::Vector2f center = sf::Vector2f(node.top_left.x + (node.bottom_right.x - node.top_left.x) / 2, node.top_left.y + (node.bottom_right.y - node.top_left.y) / 2);
+	int levelBegin(int level) const
+	{
+		return level_begin[level];
+	}
 
-		sf::Vertex box[] = { sf::Vertex(node.top_left, sf::Color::Green),
-			sf::Vertex(sf::Vector2f(node.bottom_right.x, node.top_left.y), sf::Color::Green),
-			sf::Vertex(node.bottom_right, sf::Color::Green),
-			sf::Vertex(sf::Vector2f(node.top_left.x, node.bottom_right.y), sf::Color::Green),
-			sf::Vertex(node.top_left, sf::Color::Green) };
-	
-		window.draw(box, 5, sf::LineStrip);
+	// Upward pass, one level at a time from the deepest. Nodes are numbered
+	// breadth first, so every level is a contiguous range whose nodes only
+	// read their children on the level below. Each node is summed by one
+	// thread in child order, the result does not depend on the thread count.
+	void calculateCenterMass(ThreadPool& pool)
+	{
+		resizeWithSlack(moments, nodes.size());
+		for (int level = int(level_begin.size()) - 2; level >= 0; level--)
+		{
+			pool.parallelFor(level_begin[level], level_begin[level + 1], [this](int start, int end) {
+				for (int i = start; i < end; i++)
+				{
+					if (nodes[i].isLeaf())
+						sumLeafMoments(i);
+					else
+						sumChildren(i);
+				}
+			});
+		}
 
-		if (node.isLeaf())
+		packWalkNodes(pool);
+	}
+
+	// In pre-order the first child of a node directly follows it and next
+	// skips its subtree, so a walk that opens a node keeps moving forward
+	// through memory. A node's position is its parent's plus one plus the
+	// subtree sizes of its earlier siblings. Sizes are summed bottom-up and
+	// positions assigned top-down, one level at a time.
+	void packWalkNodes(ThreadPool& pool)
+	{
+		const int levels = int(level_begin.size()) - 1;
+		resizeWithSlack(walkIndex, nodes.size());
+		if (depthFirstWalk && !nodes.empty())
+		{
+			resizeWithSlack(subtree_size, nodes.size());
+			for (int level = levels - 1; level >= 0; level--)
+			{
+				pool.parallelFor(level_begin[level], level_begin[level + 1], [this](int start, int end) {
+					for (int i = start; i < end; i++)
+					{
+						const int c = nodes[i].children;
+						subtree_size[i] = 1 + (c == 0 ? 0 : subtree_size[c] + subtree_size[c + 1] + subtree_size[c + 2] + subtree_size[c + 3]);
+					}
+				});
+			}
+			walkIndex[0] = 0;
+			for (int level = 0; level < levels; level++)
+			{
+				pool.parallelFor(level_begin[level], level_begin[level + 1], [this](int start, int end) {
+					for (int i = start; i < end; i++)
+					{
+						if (nodes[i].isLeaf())
+							continue;
+						int position = walkIndex[i] + 1;
+						for (int c = nodes[i].children; c < nodes[i].children + 4; c++)
+						{
+							walkIndex[c] = position;
+							position += subtree_size[c];
+						}
+					}
+				});
+			}
+		}
+		else
+		{
+			for (int i = 0; i < nodes.size(); i++)
+				walkIndex[i] = i;
+		}
+
+		resizeWithSlack(walkNodes, nodes.size());
+		resizeWithSlack(walkMoments, nodes.size());
+		resizeWithSlack(walkRanges, nodes.size());
+		pool.parallelFor(0, nodes.size(), [this](int start, int end) {
+			for (int i = start; i < end; i++)
+			{
+				const Node& node = nodes[i];
+				const int w = walkIndex[i];
+				walkNodes[w] = { node.center_mass.x, node.center_mass.y, node.mass, node.bottom_right.x - node.top_left.x,
+					node.isLeaf() ? 0 : walkIndex[node.children], walkIndex[node.next] };
+				walkMoments[w] = moments[i];
+				walkRanges[w] = { node.start, node.end };
+			}
+		});
+	}
+
+	void sumChildren(size_t index)
+	{
+		Node& node = nodes[index];
+		const Node* children = &nodes[node.children];
+		WalkMoments& q = moments[index];
+		q = { 0, 0, 0 };
+		for (int c = 0; c < 4; c++)
+		{
+			node.center_mass += children[c].mass * children[c].center_mass;
+			node.mass += children[c].mass;
+			node.maxRadius = std::max(node.maxRadius, children[c].maxRadius);
+		}
+		if (node.isEmpty())
 			return;
+		node.center_mass /= node.mass;
 
-		int c = node.children;
-		for (int i = 0; i < 4; i++)
+		// Parallel axis theorem: shift each child's moments to the new centre
+		for (int c = 0; c < 4; c++)
 		{
-			draw(window, c);
-			c = nodes[c].next;
+			const Node& child = children[c];
+			if (child.isEmpty())
+				continue;
+			const WalkMoments& cq = moments[node.children + c];
+			float dx = child.center_mass.x - node.center_mass.x, dy = child.center_mass.y - node.center_mass.y;
+			q.qxx += cq.qxx + child.mass * dx * dx;
+			q.qxy += cq.qxy + child.mass * dx * dy;
+			q.qyy += cq.qyy + child.mass * dy * dy;
 		}
 	}
+
+private:
+	struct KeyEntry
+	{
+		uint64_t key;
+		int index;
+	};
+
+	// Stable counting sort of src[0, count) into dst on the byte at shift.
+	// Returns false without touching dst when that byte is the same for
+	// every entry.
+	static bool radixPass(const KeyEntry* src, KeyEntry* dst, size_t count, int shift)
+	{
+		size_t offsets[257] = {};
+		for (size_t b = 0; b < count; b++)
+			offsets[((src[b].key >> shift) & 0xFF) + 1]++;
+		for (int d = 0; d < 256; d++)
+			offsets[d + 1] += offsets[d];
+		if (count == 0 || offsets[((src[0].key >> shift) & 0xFF) + 1] - offsets[(src[0].key >> shift) & 0xFF] == count)
+			return false;
+		for (size_t b = 0; b < count; b++)
+			dst[offsets[(src[b].key >> shift) & 0xFF]++] = src[b];
+		return true;
+	}
+
+	double grid_scale = 1;
+	sf::Vector2f grid_origin{ 0, 0 };
+	int depth_limit = MORTON_LEVELS;
+	int builds_since_reorder = 0, order_begin = 0;
+	uint64_t built_version = 0;
+	int built_leaf_size = 0;
+	int refits_since_build = 0, refit_skip = 0, refit_backoff = 0;
+	// Allocated from scratch by each Morton build
+	KeyEntry* entries = nullptr;
+	KeyEntry* sorted_entries = nullptr;
+	uint64_t* keys = nullptr;
+	// First node of every level of the last build, levels are not depths
+	// once chains are collapsed
+	std::vector<int> level_begin, subtree_size;
+	// Level of each node's cell on the root grid, only used while building.
+	// A node whose bodies all lie in one quadrant is shrunk to the smallest
+	// cell holding them before it splits, so it can be several levels below
+	// its parent.
+	std::vector<int> node_depth;
+	// Moments of each node, in node order, copied into walkMoments
+	std::vector<WalkMoments> moments;
 };
\ No newline at end of file
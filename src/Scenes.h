@@ -0,0 +1,124 @@
+#pragma once
+#include "Body.h"
+#include "Spawner.h"
+#include <SFML/System/Vector2.hpp>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Reproducible initial states for runs without a window. Every scene is
+// centred on the default view (1200 x 800 meters) and is fully determined
+// by the body count and the seed.
+namespace Scenes
+{
+	const sf::Vector2f CENTER(600.0f, 400.0f);
+	const float BODY_RADIUS = 0.5f;
+	const float MASS_COEFF = 2e11f;
+
+	// Bodies spread uniformly over a disk, initially at rest.
+	void uniformDisk(Spawner& spawner, int count, unsigned int seed)
+	{
+		std::mt19937 rng(seed);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float disk_radius = 350.0f;
+		for (int i = 0; i < count; i++)
+		{
+			float r = disk_radius * std::sqrt(unit(rng));
+			float angle = 2 * Constants::PI * unit(rng);
+			spawner.spawnBody(sf::Vector2f(CENTER.x + r * std::cos(angle), CENTER.y + r * std::sin(angle)),
+				BODY_RADIUS, MASS_COEFF, sf::Vector2f(0, 0));
+		}
+	}
+
+	// A Plummer sphere projected onto the plane: centrally concentrated with a
+	// long tail, the usual worst case for tree depth and walk imbalance.
+	void plummer(Spawner& spawner, int count, unsigned int seed)
+	{
+		std::mt19937 rng(seed);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float scale_radius = 40.0f, max_radius = 2000.0f;
+		for (int i = 0; i < count; i++)
+		{
+			float u = std::max(unit(rng), 1e-6f);
+			float r = std::min(max_radius, scale_radius / std::sqrt(std::pow(u, -2.0f / 3.0f) - 1.0f));
+			float cos_theta = 2 * unit(rng) - 1;
+			float projected = r * std::sqrt(1 - cos_theta * cos_theta);
+			float angle = 2 * Constants::PI * unit(rng);
+			spawner.spawnBody(sf::Vector2f(CENTER.x + projected * std::cos(angle), CENTER.y + projected * std::sin(angle)),
+				BODY_RADIUS, MASS_COEFF, sf::Vector2f(0, 0));
+		}
+	}
+
+	// A square Spawner::spawnWall lattice with at least `count` bodies. It is
+	// deterministic, the seed is only taken to match the other scenes.
+	void wall(Spawner& spawner, int count, unsigned int /*seed*/)
+	{
+		int side = std::max(1, int(std::ceil(std::sqrt(float(count)))));
+		float space = 2 * BODY_RADIUS;
+		float length = side * (space + BODY_RADIUS);
+		spawner.spawnWall(CENTER - sf::Vector2f(length / 2, length / 2), side, side, BODY_RADIUS, space, MASS_COEFF);
+	}
+
+	// Dense Spawner::spawnCircle clusters dropped at random positions until
+	// at least `count` bodies exist, like repeated middle clicks in the GUI.
+	void circles(Spawner& spawner, int count, unsigned int seed)
+	{
+		std::mt19937 rng(seed);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const size_t target = spawner.bodies.size() + count;
+		while (spawner.bodies.size() < target)
+		{
+			sf::Vector2f center(CENTER.x + (unit(rng) - 0.5f) * 1000.0f, CENTER.y + (unit(rng) - 0.5f) * 700.0f);
+			spawner.spawnCircle(center, BODY_RADIUS, BODY_RADIUS, 5, 4, MASS_COEFF);
+		}
+	}
+
+	bool generate(const std::string& name, Spawner& spawner, int count, unsigned int seed)
+	{
+		if (name == "disk")
+			uniformDisk(spawner, count, seed);
+		else if (name == "plummer")
+			plummer(spawner, count, seed);
+		else if (name == "wall")
+			wall(spawner, count, seed);
+		else if (name == "circles")
+			circles(spawner, count, seed);
+		else
+			return false;
+		return true;
+	}
+
+	// Plain text state: one body per line as "x y vx vy mass radius fixed",
+	// where the velocity is the displacement per step.
+	bool load(const std::string& path, Bodies& bodies)
+	{
+		std::ifstream in(path);
+		if (!in)
+			return false;
+		float x, y, vx, vy, mass, radius;
+		int fixed;
+		while (in >> x >> y >> vx >> vy >> mass >> radius >> fixed)
+		{
+			bodies.push_back(Body(sf::Vector2f(x, y), mass, radius, sf::Vector2f(vx, vy), fixed != 0));
+		}
+		return true;
+	}
+
+	bool save(const std::string& path, const Bodies& bodies)
+	{
+		std::ofstream out(path);
+		if (!out)
+			return false;
+		out.precision(9);
+		for (size_t i = 0; i < bodies.size(); i++)
+		{
+			Body body = bodies.get(i);
+			sf::Vector2f velocity = body.center - body.prev_center;
+			out << body.center.x << " " << body.center.y << " " << velocity.x << " " << velocity.y << " "
+				<< body.mass << " " << body.radius << " " << int(body.fixed) << "\n";
+		}
+		return true;
+	}
+}
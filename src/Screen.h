@@ -3,6 +3,7 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include "Constants.h"
 
 namespace Screen
 {
@@ -74,15 +75,4 @@ namespace Screen
 	{
 		return sf::Vector2f(X, Y);
 	}
-}
-
-namespace Constants
-{
-	const float G = 6.67e-11f;
-	const int FPS = 60;
-	const float dt = 0.005f;
-	const float PI = 3.1415;
-
-	float CURRENT_FPS = 0.0f;
-	std::string mode = "CIRCLE";
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+#include "BodySimulation.h"
+#include "Screen.h"
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+
+// Draws all bodies with two draw calls: point-sized bodies from one point
+// array and larger bodies as textured quads from one quad array, both
+// filled in a single pass over the body positions.
+class SimulationRenderer
+{
+public:
+	BodySimulation& sim;
+	sf::VertexArray points{ sf::Points };
+	sf::VertexArray quads{ sf::Quads };
+	sf::VertexArray lines{ sf::Lines };
+	sf::Texture circleTexture;
+
+	SimulationRenderer(BodySimulation& sim) : sim(sim)
+	{
+		const unsigned int size = 64;
+		const float r = size / 2.0f;
+		sf::Image image;
+		image.create(size, size, sf::Color::Transparent);
+		for (unsigned int y = 0; y < size; y++)
+		{
+			for (unsigned int x = 0; x < size; x++)
+			{
+				float dx = x + 0.5f - r, dy = y + 0.5f - r;
+				float coverage = std::max(0.0f, std::min(1.0f, r - std::sqrt(dx * dx + dy * dy)));
+				image.setPixel(x, y, sf::Color(255, 255, 255, sf::Uint8(255 * coverage)));
+			}
+		}
+		circleTexture.loadFromImage(image);
+		circleTexture.setSmooth(true);
+	}
+
+	void draw(sf::RenderWindow& window)
+	{
+		const Bodies& bodies = sim.bodies;
+		const sf::Vector2f texture_size(circleTexture.getSize());
+		points.clear();
+		quads.clear();
+
+		for (size_t i = 0; i < bodies.size(); i++)
+		{
+			if (!isInWindow(i))
+				continue;
+			const float radius = bodies.radius[i];
+			const sf::Vector2f center(bodies.x[i], bodies.y[i]);
+			float pixel_radius = Screen::convertMetersToPixels(sf::Vector2f(radius, radius)).x;
+			if (pixel_radius <= 1)
+			{
+				points.append(sf::Vertex(center, Screen::BODY_COLOR));
+			}
+			else
+			{
+				quads.append(sf::Vertex(center + sf::Vector2f(-radius, -radius), Screen::BODY_COLOR, sf::Vector2f(0, 0)));
+				quads.append(sf::Vertex(center + sf::Vector2f(radius, -radius), Screen::BODY_COLOR, sf::Vector2f(texture_size.x, 0)));
+				quads.append(sf::Vertex(center + sf::Vector2f(radius, radius), Screen::BODY_COLOR, texture_size));
+				quads.append(sf::Vertex(center + sf::Vector2f(-radius, radius), Screen::BODY_COLOR, sf::Vector2f(0, texture_size.y)));
+			}
+		}
+
+		window.draw(points);
+		window.draw(quads, &circleTexture);
+
+		if (sim.showQuadTree)
+			drawQuadTree(window, sim.bh.head);
+	}
+
+	bool isInWindow(size_t i) const
+	{
+		const Bodies& bodies = sim.bodies;
+		if (!bodies.isEnabled(i))
+			return false;
+		int Xn = std::max(Screen::TOP_LEFT.x, std::min(bodies.x[i], Screen::BOTTOM_RIGHT.x));
+		int Yn = std::max(Screen::TOP_LEFT.y, std::min(bodies.y[i], Screen::BOTTOM_RIGHT.y));
+		int Dx = Xn - bodies.x[i];
+		int Dy = Yn - bodies.y[i];
+		return (Dx * Dx + Dy * Dy) <= bodies.radius[i] * bodies.radius[i];
+	}
+
+	void drawQuadTree(sf::RenderWindow& window, const QuadTree& tree)
+	{
+		lines.clear();
+		for (const Node& node : tree.nodes)
+		{
+			sf::Vector2f corners[] = { node.top_left, sf::Vector2f(node.bottom_right.x, node.top_left.y),
+				node.bottom_right, sf::Vector2f(node.top_left.x, node.bottom_right.y) };
+			for (int i = 0; i < 4; i++)
+			{
+				lines.append(sf::Vertex(corners[i], sf::Color::Green));
+				lines.append(sf::Vertex(corners[(i + 1) % 4], sf::Color::Green));
+			}
+		}
+		window.draw(lines);
+	}
+};
@@ -5,8 +5,8 @@
 class Spawner
 {
 public:
-	std::vector<Body>& bodies;
-	Spawner(std::vector<Body>& bodies) : bodies(bodies) {}
+	Bodies& bodies;
+	Spawner(Bodies& bodies) : bodies(bodies) {}
 
 	void spawnBody(sf::Vector2f center, float radius, float mass_coeff, sf::Vector2f velocity)
 	{
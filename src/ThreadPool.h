@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Non-owning reference to a callable. Unlike std::function it never
+// allocates, which is safe here because the pool calls a task only until
+// run() returns, while the caller's lambda is still alive.
+template <typename Signature>
+class FunctionRef;
+
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)>
+{
+public:
+	template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, FunctionRef>::value>>
+	FunctionRef(F&& f)
+		: object(const_cast<void*>(static_cast<const void*>(std::addressof(f)))),
+		call([](void* object, Args... args) -> R { return (*static_cast<std::remove_reference_t<F>*>(object))(std::forward<Args>(args)...); })
+	{
+	}
+
+	R operator()(Args... args) const
+	{
+		return call(object, std::forward<Args>(args)...);
+	}
+
+private:
+	void* object;
+	R (*call)(void*, Args...);
+};
+
+// Long-lived worker threads shared by every parallel phase of a step.
+// The calling thread takes part as thread 0, workers sleep on a condition
+// variable between jobs instead of being created and joined every frame.
+class ThreadPool
+{
+public:
+	ThreadPool(int num_threads)
+	{
+		resize(num_threads);
+	}
+
+	~ThreadPool()
+	{
+		stopWorkers();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const
+	{
+		return int(workers.size()) + 1;
+	}
+
+	void resize(int num_threads)
+	{
+		num_threads = std::max(1, num_threads);
+		if (num_threads == size())
+			return;
+		stopWorkers();
+		stopping = false;
+		for (int i = 1; i < num_threads; i++)
+			workers.emplace_back([this, i, seen = generation]() { workerLoop(i, seen); });
+	}
+
+	// Runs task(thread_index) once on every thread and waits for all of them.
+	void run(FunctionRef<void(int)> task)
+	{
+		if (workers.empty())
+		{
+			task(0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &task;
+			pending = int(workers.size());
+			generation++;
+		}
+		wake.notify_all();
+		task(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return pending == 0; });
+		job = nullptr;
+	}
+
+	// Splits [begin, end) into one contiguous range per thread and calls
+	// fn(range_begin, range_end) for each of them.
+	void parallelFor(int begin, int end, FunctionRef<void(int, int)> fn)
+	{
+		const int count = end - begin;
+		if (count <= 0)
+			return;
+		const int threads = std::min(size(), count);
+		run([&](int thread) {
+			if (thread >= threads)
+				return;
+			fn(begin + int(1LL * count * thread / threads), begin + int(1LL * count * (thread + 1) / threads));
+		});
+	}
+
+	// Like parallelFor, but threads repeatedly claim the next `chunk` indices
+	// from a shared counter, so threads that get cheap ranges simply take
+	// more of them. Use when the cost per index varies a lot. fn receives
+	// (range_begin, range_end, thread_index).
+	void parallelForDynamic(int begin, int end, int chunk, FunctionRef<void(int, int, int)> fn)
+	{
+		if (end <= begin)
+			return;
+		chunk = std::max(1, chunk);
+		std::atomic<int> next(begin);
+		run([&](int thread) {
+			while (true)
+			{
+				int start = next.fetch_add(chunk, std::memory_order_relaxed);
+				if (start >= end)
+					return;
+				fn(start, std::min(end, start + chunk), thread);
+			}
+		});
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const FunctionRef<void(int)>* job = nullptr;
+	unsigned long long generation = 0;
+	int pending = 0;
+	bool stopping = false;
+
+	void workerLoop(int index, unsigned long long seen)
+	{
+		while (true)
+		{
+			const FunctionRef<void(int)>* task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this, seen]() { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				task = job;
+			}
+			(*task)(index);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pending--;
+				if (pending == 0)
+					done.notify_one();
+			}
+		}
+	}
+
+	void stopWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+		workers.clear();
+	}
+};
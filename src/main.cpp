@@ -1,6 +1,7 @@
 #include "Body.h"
 #include "Screen.h"
 #include "BodySimulation.h"
+#include "SimulationRenderer.h"
 #include "MouseInputHandler.h"
 #include "Buttons.h"
 #include "Menu.h"
@@ -13,8 +14,9 @@ int main()
 	srand(time(NULL));
 	Screen::window.create(sf::VideoMode(Screen::WIDTH, Screen::HEIGHT), "BarnesHut", sf::Style::Close | sf::Style::Titlebar | sf::Style::Resize);
 	Screen::window.setFramerateLimit(Constants::FPS);
-	std::vector<Body> bodies;
-	BodySimulation sim(bodies, 0.6f, 10);
+	Bodies bodies;
+	BodySimulation sim(bodies, 0.8f, 10);
+	SimulationRenderer renderer(sim);
 	MouseInputHandler mouseHandler(Screen::window, sim);
 
 	Menu menu(sim);
@@ -45,7 +47,7 @@ int main()
 
 		sim.update(Constants::dt);
 
-		sim.draw(Screen::window);
+		renderer.draw(Screen::window);
 
 		Screen::window.draw(menu.handler);
 
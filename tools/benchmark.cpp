@@ -0,0 +1,287 @@
+#include "Body.h"
+#include "BodySimulation.h"
+#include "Scenes.h"
+#include "Spawner.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Times every simulation phase on its own over fixed-seed workloads and
+// prints one machine-readable row per (configuration, phase).
+//
+//   GravitySimulationBenchmark [--scenes disk,plummer,wall,circles]
+//                              [--sizes 1000,10000,100000,1000000,2000000]
+//                              [--leaf 10] [--threshold 0.8] [--threads 1,2,4]
+//                              [--walk group,body] [--solver bh,fmm] [--build morton,partition]
+//                              [--layout bfs,dfs] [--broadphase tree,grid] [--contact-cache 1,0]
+//                              [--refit 0,4] [--reorder 1,4]
+//                              [--warmup 3] [--repeat 5] [--seed 1]
+//                              [--format csv|json] [--out FILE]
+//
+// Every list option is swept. Each configuration runs one simulation whose
+// first --warmup steps are not timed, so that arenas are sized, contact
+// lists built and refitting under way. Each repetition then times one step
+// phase by phase and the next as a whole; rows report the median and
+// minimum over the repetitions in milliseconds.
+
+struct Config
+{
+	std::string scene, walk, solver, build, layout, broadphase;
+	int requested, bodies, maxLeafSize, threads, contactCache, refit, reorder;
+	float threshold;
+};
+
+struct Result
+{
+	Config config;
+	std::string phase;
+	double median_ms, min_ms;
+};
+
+std::vector<std::string> splitList(const std::string& value)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(value);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+template <typename T>
+std::vector<T> parseList(const std::string& value, T (*convert)(const std::string&))
+{
+	std::vector<T> items;
+	for (const std::string& item : splitList(value))
+		items.push_back(convert(item));
+	return items;
+}
+
+int toInt(const std::string& s) { return std::atoi(s.c_str()); }
+float toFloat(const std::string& s) { return float(std::atof(s.c_str())); }
+
+double timeMs(const std::function<void()>& fn)
+{
+	auto begin = std::chrono::steady_clock::now();
+	fn();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+class PhaseTimer
+{
+public:
+	std::vector<std::string> phases;
+	std::vector<std::vector<double>> samples;
+
+	void add(const std::string& phase, double ms)
+	{
+		auto it = std::find(phases.begin(), phases.end(), phase);
+		if (it == phases.end())
+		{
+			phases.push_back(phase);
+			samples.emplace_back();
+			it = phases.end() - 1;
+		}
+		samples[it - phases.begin()].push_back(ms);
+	}
+
+	void report(const Config& config, std::vector<Result>& results)
+	{
+		for (size_t i = 0; i < phases.size(); i++)
+		{
+			std::vector<double>& s = samples[i];
+			std::sort(s.begin(), s.end());
+			results.push_back({ config, phases[i], s[s.size() / 2], s.front() });
+		}
+	}
+};
+
+void runConfig(const Config& config, const Bodies& initial, int warmup, int repeat, std::vector<Result>& results)
+{
+	PhaseTimer timer;
+	Bodies bodies = initial;
+	BodySimulation sim(bodies, config.threshold, config.maxLeafSize);
+	sim.pool.resize(config.threads);
+	sim.bh.groupWalk = config.walk != "body";
+	sim.bh.head.mortonBuild = config.build != "partition";
+	sim.bh.head.depthFirstWalk = config.layout == "dfs";
+	sim.bh.head.refitSteps = config.refit;
+	sim.bh.head.reorderInterval = config.reorder;
+	sim.collision_handler.broadphase = config.broadphase == "grid" ? Broadphase::GRID : Broadphase::TREE;
+	sim.collision_handler.cacheContacts = config.contactCache != 0;
+	sim.solver = config.solver == "fmm" ? GravitySolver::FAST_MULTIPOLE : GravitySolver::BARNES_HUT;
+
+	for (int w = 0; w < warmup; w++)
+		sim.update(Constants::dt);
+	for (int r = 0; r < repeat; r++)
+	{
+		// The phases of BodySimulation::update, with createTree split into
+		// the node pass and the upward pass
+		bodies.compact();
+		timer.add("tree_build", timeMs([&]() {
+			sim.bh.updateFixedTree(sim.pool);
+			sim.bh.head.buildOrRefitNodes(sim.pool, sim.treeRefit());
+		}));
+		timer.add("center_mass", timeMs([&]() { sim.bh.head.calculateCenterMass(sim.pool); }));
+		timer.add("collisions", timeMs([&]() { sim.handleCollisions(); }));
+		timer.add("gravity", timeMs([&]() { sim.applyGravity(); }));
+		timer.add("integrate", timeMs([&]() { sim.integrate(Constants::dt); }));
+		bodies.compact();
+
+		timer.add("full_step", timeMs([&]() { sim.update(Constants::dt); }));
+	}
+	timer.report(config, results);
+}
+
+void writeCsv(std::ostream& out, const std::vector<Result>& results)
+{
+	out << "scene,requested_n,n,max_leaf_size,threshold,threads,walk,solver,build,layout,broadphase,contact_cache,refit,reorder,phase,median_ms,min_ms\n";
+	for (const Result& r : results)
+	{
+		out << r.config.scene << "," << r.config.requested << "," << r.config.bodies << "," << r.config.maxLeafSize << ","
+			<< r.config.threshold << "," << r.config.threads << "," << r.config.walk << "," << r.config.solver << "," << r.config.build << "," << r.config.layout << "," << r.config.broadphase << "," << r.config.contactCache << "," << r.config.refit << "," << r.config.reorder << "," << r.phase << "," << r.median_ms << "," << r.min_ms << "\n";
+	}
+}
+
+void writeJson(std::ostream& out, const std::vector<Result>& results)
+{
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		out << "  {\"scene\": \"" << r.config.scene << "\", \"requested_n\": " << r.config.requested
+			<< ", \"n\": " << r.config.bodies << ", \"max_leaf_size\": " << r.config.maxLeafSize
+			<< ", \"threshold\": " << r.config.threshold << ", \"threads\": " << r.config.threads
+			<< ", \"walk\": \"" << r.config.walk << "\", \"solver\": \"" << r.config.solver << "\", \"build\": \"" << r.config.build << "\", \"layout\": \"" << r.config.layout << "\", \"broadphase\": \"" << r.config.broadphase << "\", \"contact_cache\": " << r.config.contactCache
+			<< ", \"refit\": " << r.config.refit << ", \"reorder\": " << r.config.reorder
+			<< ", \"phase\": \"" << r.phase << "\", \"median_ms\": " << r.median_ms
+			<< ", \"min_ms\": " << r.min_ms << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "]\n";
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> scenes = { "disk", "plummer", "wall", "circles" };
+	std::vector<int> sizes = { 1000, 10000, 100000, 1000000, 2000000 };
+	std::vector<int> leafSizes = { 10 };
+	std::vector<float> thresholds = { 0.8f };
+	std::vector<int> threadCounts = { int(std::max(1u, std::thread::hardware_concurrency())) };
+	std::vector<std::string> walks = { "group" };
+	std::vector<std::string> solvers = { "bh" };
+	std::vector<std::string> builds = { "morton" };
+	std::vector<std::string> layouts = { "bfs" };
+	std::vector<std::string> broadphases = { "tree" };
+	std::vector<int> contactCaches = { 1 };
+	std::vector<int> refits = { 0 };
+	std::vector<int> reorders = { 1 };
+	int warmup = 3, repeat = 5;
+	unsigned int seed = 1;
+	std::string format = "csv", outPath;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			std::cerr << "missing value for " << arg << "\n";
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--scenes")
+			scenes = splitList(value);
+		else if (arg == "--sizes")
+			sizes = parseList(value, toInt);
+		else if (arg == "--leaf")
+			leafSizes = parseList(value, toInt);
+		else if (arg == "--threshold")
+			thresholds = parseList(value, toFloat);
+		else if (arg == "--threads")
+			threadCounts = parseList(value, toInt);
+		else if (arg == "--walk")
+			walks = splitList(value);
+		else if (arg == "--solver")
+			solvers = splitList(value);
+		else if (arg == "--build")
+			builds = splitList(value);
+		else if (arg == "--layout")
+			layouts = splitList(value);
+		else if (arg == "--broadphase")
+			broadphases = splitList(value);
+		else if (arg == "--contact-cache")
+			contactCaches = parseList(value, toInt);
+		else if (arg == "--refit")
+			refits = parseList(value, toInt);
+		else if (arg == "--reorder")
+			reorders = parseList(value, toInt);
+		else if (arg == "--warmup")
+			warmup = std::max(0, toInt(value));
+		else if (arg == "--repeat")
+			repeat = std::max(1, toInt(value));
+		else if (arg == "--seed")
+			seed = std::strtoul(value.c_str(), nullptr, 10);
+		else if (arg == "--format")
+			format = value;
+		else if (arg == "--out")
+			outPath = value;
+		else
+		{
+			std::cerr << "unknown option " << arg << "\n";
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+	for (const std::string& scene : scenes)
+	{
+		for (int size : sizes)
+		{
+			Bodies initial;
+			Spawner spawner(initial);
+			if (!Scenes::generate(scene, spawner, size, seed))
+			{
+				std::cerr << "unknown scene " << scene << "\n";
+				return 1;
+			}
+			for (int leaf : leafSizes)
+				for (float threshold : thresholds)
+					for (int threads : threadCounts)
+						for (const std::string& walk : walks)
+							for (const std::string& solver : solvers)
+								for (const std::string& build : builds)
+									for (const std::string& layout : layouts)
+										for (const std::string& broadphase : broadphases)
+											for (int contactCache : contactCaches)
+												for (int refit : refits)
+													for (int reorder : reorders)
+													{
+														Config config{ scene, walk, solver, build, layout, broadphase, size, int(initial.size()), leaf, std::max(1, threads), contactCache,
+															refit, std::max(1, reorder), threshold };
+														std::cerr << scene << " n=" << config.bodies << " leaf=" << leaf << " threshold=" << threshold
+															<< " threads=" << config.threads << " walk=" << walk << " solver=" << solver
+															<< " build=" << build << " layout=" << layout << " broadphase=" << broadphase
+															<< " contact_cache=" << contactCache << " refit=" << refit << " reorder=" << config.reorder << std::endl;
+														runConfig(config, initial, warmup, repeat, results);
+													}
+		}
+	}
+
+	std::ofstream file;
+	if (!outPath.empty())
+		file.open(outPath);
+	std::ostream& out = outPath.empty() ? std::cout : file;
+	if (format == "json")
+		writeJson(out, results);
+	else
+		writeCsv(out, results);
+}
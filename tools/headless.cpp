@@ -0,0 +1,151 @@
+#include "Body.h"
+#include "BodySimulation.h"
+#include "Scenes.h"
+#include "Spawner.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Runs BodySimulation::update as fast as possible without opening a window.
+//
+//   GravitySimulationHeadless [--steps N] [--bodies N] [--scene disk|plummer|wall|circles]
+//                             [--seed S] [--load FILE] [--save FILE] [--threads T]
+//                             [--threshold F] [--leaf N] [--collisions N] [--dt F]
+//                             [--walk group|body] [--quadrupole 0|1] [--solver bh|fmm] [--order P]
+//                             [--build morton|partition] [--reorder K] [--refit K]
+//                             [--broadphase tree|grid] [--contact-cache 0|1]
+
+void printUsage()
+{
+	std::cerr << "usage: GravitySimulationHeadless [--steps N] [--bodies N] [--scene disk|plummer|wall|circles]\n"
+		<< "                                 [--seed S] [--load FILE] [--save FILE] [--threads T]\n"
+		<< "                                 [--threshold F] [--leaf N] [--collisions N] [--dt F]\n"
+		<< "                                 [--walk group|body] [--quadrupole 0|1] [--solver bh|fmm] [--order P]\n"
+		<< "                                 [--build morton|partition] [--reorder K] [--refit K]\n"
+		<< "                                 [--broadphase tree|grid] [--contact-cache 0|1]\n";
+}
+
+int main(int argc, char** argv)
+{
+	int steps = 1000, count = 100000, threads = 0, maxLeafSize = 10, collisionPrecision = 2;
+	unsigned int seed = 1;
+	float threshold = 0.8f, dt = Constants::dt;
+	std::string scene = "disk", loadPath, savePath, walk = "group", solver = "bh", build = "morton", broadphase = "tree";
+	int order = 4, quadrupole = 1, reorder = 1, refit = 0, contactCache = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			printUsage();
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--steps")
+			steps = std::atoi(value.c_str());
+		else if (arg == "--bodies")
+			count = std::atoi(value.c_str());
+		else if (arg == "--scene")
+			scene = value;
+		else if (arg == "--seed")
+			seed = std::strtoul(value.c_str(), nullptr, 10);
+		else if (arg == "--load")
+			loadPath = value;
+		else if (arg == "--save")
+			savePath = value;
+		else if (arg == "--threads")
+			threads = std::atoi(value.c_str());
+		else if (arg == "--threshold")
+			threshold = std::atof(value.c_str());
+		else if (arg == "--leaf")
+			maxLeafSize = std::atoi(value.c_str());
+		else if (arg == "--collisions")
+			collisionPrecision = std::atoi(value.c_str());
+		else if (arg == "--dt")
+			dt = std::atof(value.c_str());
+		else if (arg == "--walk")
+			walk = value;
+		else if (arg == "--quadrupole")
+			quadrupole = std::atoi(value.c_str());
+		else if (arg == "--solver")
+			solver = value;
+		else if (arg == "--build")
+			build = value;
+		else if (arg == "--reorder")
+			reorder = std::atoi(value.c_str());
+		else if (arg == "--refit")
+			refit = std::atoi(value.c_str());
+		else if (arg == "--broadphase")
+			broadphase = value;
+		else if (arg == "--contact-cache")
+			contactCache = std::atoi(value.c_str());
+		else if (arg == "--order")
+			order = std::atoi(value.c_str());
+		else
+		{
+			printUsage();
+			return 1;
+		}
+	}
+
+	Bodies bodies;
+	Spawner spawner(bodies);
+	if (!loadPath.empty())
+	{
+		if (!Scenes::load(loadPath, bodies))
+		{
+			std::cerr << "could not read " << loadPath << "\n";
+			return 1;
+		}
+	}
+	else if (!Scenes::generate(scene, spawner, count, seed))
+	{
+		std::cerr << "unknown scene " << scene << "\n";
+		return 1;
+	}
+
+	BodySimulation sim(bodies, threshold, maxLeafSize);
+	sim.collisionPrecision = collisionPrecision;
+	sim.bh.groupWalk = walk != "body";
+	sim.bh.useQuadrupole = quadrupole != 0;
+	sim.bh.head.mortonBuild = build != "partition";
+	sim.bh.head.reorderInterval = reorder;
+	sim.bh.head.refitSteps = refit;
+	sim.collision_handler.broadphase = broadphase == "grid" ? Broadphase::GRID : Broadphase::TREE;
+	sim.collision_handler.cacheContacts = contactCache != 0;
+	sim.solver = solver == "fmm" ? GravitySolver::FAST_MULTIPOLE : GravitySolver::BARNES_HUT;
+	sim.fmm.order = order;
+	if (threads > 0)
+		sim.pool.resize(threads);
+
+	const size_t initial_count = bodies.size();
+	size_t body_steps = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < steps; i++)
+	{
+		body_steps += bodies.size();
+		sim.update(dt);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "bodies:            " << initial_count << " -> " << bodies.size() << "\n"
+		<< "threads:           " << sim.pool.size() << "\n"
+		<< "gravity kernel:    " << GravityKernel::get().name << "\n"
+		<< "gravity solver:    " << (sim.solver == GravitySolver::FAST_MULTIPOLE ? "fmm, order " + std::to_string(sim.fmm.order)
+			: std::string("barnes-hut, ") + (sim.bh.groupWalk ? "group walk" : "body walk")
+				+ (sim.bh.useQuadrupole ? ", quadrupole" : ", monopole")) << "\n"
+		<< "steps:             " << steps << "\n"
+		<< "seconds:           " << seconds << "\n"
+		<< "steps/sec:         " << steps / seconds << "\n"
+		<< "bodies*steps/sec:  " << body_steps / seconds << "\n";
+
+	if (!savePath.empty() && !Scenes::save(savePath, bodies))
+	{
+		std::cerr << "could not write " << savePath << "\n";
+		return 1;
+	}
+}